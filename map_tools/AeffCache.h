@@ -0,0 +1,82 @@
+/** @file AeffCache.h
+    @brief definition of the class AeffCache
+
+    $Header$
+*/
+#ifndef MAP_TOOLS_AEFFCACHE_H
+#define MAP_TOOLS_AEFFCACHE_H
+
+#include "map_tools/BinnerTable.h"
+
+#include <string>
+#include <vector>
+
+namespace map_tools {
+
+/**
+@class AeffCache
+@brief A directory of effective area tables, saved by a key made from what they depend on
+
+The tables for a set of energies depend only on the response functions, the energies, the
+theta cut, whether phi is used, and the binning of the cube. The key is a hash of these,
+of the CALDB environment variable, and of the name, size and modification time of the files
+that the response functions are read from, so a change of any of them, including an update
+of the CALDB in place, gives a new entry.
+
+Each entry is a binary file, "aeff_<key>.bin", in native byte order: an 8-byte tag,
+the number of layers, of bins and the phi flag as 64-bit integers, the etendue of each
+layer, the number of coefficients of each layer, then the coefficients, bins per layer.
+It is written to a temporary name and renamed, so that jobs sharing the directory never
+read a partial file, and read by mapping it into memory.
+*/
+class AeffCache {
+public:
+    /** @class Entry
+        @brief the tables for a set of energies
+    */
+    class Entry {
+    public:
+        Entry(): use_phi(false){}
+        std::vector<BinnerTable> tables; ///< one per energy
+        std::vector<double> etendue;     ///< one per energy, for the log
+        bool use_phi;  ///< whether the tables use phi, after allowing for the response functions
+    };
+
+    //! use the directory, creating it if needed
+    AeffCache(const std::string& directory);
+
+    /** @return the key for the tables
+        @param irfs name of the response functions, or group of them
+        @param files the files they are read from, as found by irfFiles
+        @param energies energy of each layer
+        @param ctcutoff the cos(theta) cut
+        @param use_phi whether phi dependence is requested
+        The binning is that of healpix::CosineBinner, which must be set for the cube.
+    */
+    static std::string key(const std::string& irfs, const std::vector<std::string>& files,
+        const std::vector<double>& energies, double ctcutoff, bool use_phi);
+
+    /** @return the files that a set of response functions is read from, sorted
+        @param irfs names of the response functions, such as P8R3_SOURCE_V3::FRONT, or of a group
+        of them, such as P8R3_SOURCE_V3: no loader is needed
+        These are the CALDB index and the effective area files whose names include the name of
+        one of them, without its event type, found under $CALDB, as the root of the CALDB or
+        its data/glast/lat directory, and in $CUSTOM_IRF_DIR.
+    */
+    static std::vector<std::string> irfFiles(const std::vector<std::string>& irfs);
+
+    //! @return true, and set entry, if there are tables for the key
+    bool find(const std::string& key, Entry& entry)const;
+
+    //! save the tables for the key
+    void store(const std::string& key, const Entry& entry)const;
+
+    //! the file for a key
+    std::string path(const std::string& key)const;
+
+private:
+    std::string m_directory;
+};
+
+} // namespace map_tools
+#endif
@@ -0,0 +1,55 @@
+/** @file AlignedAllocator.h
+    @brief definition of the class AlignedAllocator
+
+    $Header$
+*/
+#ifndef MAP_TOOLS_ALIGNEDALLOCATOR_H
+#define MAP_TOOLS_ALIGNEDALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+
+namespace map_tools {
+
+/** @class AlignedAllocator
+    @brief std::allocator replacement that aligns the storage of a container, for SIMD loads
+
+    The raw block is obtained from operator new, with room to shift the start to the
+    requested boundary; the original pointer is kept just before the aligned address.
+
+    @param T type of the elements
+    @param Alignment required alignment in bytes: a power of 2, at least sizeof(void*)
+*/
+template <class T, std::size_t Alignment=64>
+class AlignedAllocator {
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef std::size_t size_type;
+    template<class U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+    AlignedAllocator(){}
+    template<class U> AlignedAllocator(const AlignedAllocator<U, Alignment>&){}
+
+    T* allocate(std::size_t n)
+    {
+        char* raw = static_cast<char*>(::operator new(n*sizeof(T)+Alignment));
+        std::size_t shift = Alignment - reinterpret_cast<std::size_t>(raw) % Alignment;
+        char* aligned = raw + shift; // at least sizeof(void*) past raw
+        reinterpret_cast<void**>(aligned)[-1] = raw;
+        return reinterpret_cast<T*>(aligned);
+    }
+    void deallocate(T* p, std::size_t)
+    {
+        if( p!=0 ) ::operator delete( reinterpret_cast<void**>(p)[-1] );
+    }
+};
+
+template<class T, class U, std::size_t A>
+bool operator==(const AlignedAllocator<T,A>&, const AlignedAllocator<U,A>&){return true;}
+template<class T, class U, std::size_t A>
+bool operator!=(const AlignedAllocator<T,A>&, const AlignedAllocator<U,A>&){return false;}
+
+} // namespace map_tools
+#endif
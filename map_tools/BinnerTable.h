@@ -0,0 +1,105 @@
+/** @file BinnerTable.h
+    @brief definition of the class BinnerTable
+
+    $Header$
+*/
+#ifndef MAP_TOOLS_BINNERTABLE_H
+#define MAP_TOOLS_BINNERTABLE_H
+
+#include "healpix/CosineBinner.h"
+
+#include <vector>
+#include <map>
+#include <utility>
+#include <algorithm>
+
+namespace map_tools {
+
+/**
+@class BinnerTable
+@brief A function of cos(theta), and optionally phi, tabulated over the bins of a CosineBinner
+
+CosineBinner::operator()(fun) and CosineBinner::integral(fun) are sums over the bins of the
+contents times fun at the bin. The table holds the coefficient of each bin, so that the
+same sum, for any binner with the same binning, is a dot product: fun is evaluated once per
+bin, rather than once per bin for every pixel.
+
+The coefficients are found by applying the binner's own sum to a binner with one unit bin,
+so they follow whatever bin centers and phi folding CosineBinner uses.
+*/
+class BinnerTable {
+public:
+    /** @brief ctor
+        @param fun function with operator()(costh), and integral(costh, phi) if use_phi
+        @param prototype a binner with the binning to tabulate; its contents are not used
+        @param use_phi true to tabulate CosineBinner::integral, false for CosineBinner::operator()
+    */
+    template<class F>
+    BinnerTable(const F& fun, const healpix::CosineBinner& prototype, bool use_phi)
+    {
+        healpix::CosineBinner unit(prototype);
+        std::fill(unit.begin(), unit.end(), 0.f);
+        Memo<F> memo(fun);
+        m_values.resize(unit.size());
+        for( size_t j=0; j<unit.size(); ++j){
+            healpix::CosineBinner::iterator bin(unit.begin()+j);
+            *bin = 1.f;
+            m_values[j] = use_phi? unit.integral(memo) : unit(memo);
+            *bin = 0.f;
+        }
+        // the bins that do not contribute, such as the phi bins for operator(), need not be scanned
+        while( !m_values.empty() && m_values.back()==0 ) m_values.pop_back();
+    }
+
+    //! a table with the given coefficients, such as one saved by AeffCache
+    BinnerTable(const double* begin, const double* end): m_values(begin, end){}
+
+    //! @return the sum over the bins of the contents times the function
+    double operator()(const healpix::CosineBinner& binner)const
+    {
+        const double* t(m_values.empty()? 0 : &m_values[0]);
+        healpix::CosineBinner::const_iterator b(binner.begin());
+        size_t n(std::min(m_values.size(), binner.size()));
+        double sum(0);
+        for( size_t j=0; j<n; ++j) sum += t[j]*b[j];
+        return sum;
+    }
+
+    //! number of bins with a coefficient
+    size_t size()const{return m_values.size();}
+    //! coefficient of bin j
+    double operator[](size_t j)const{return m_values[j];}
+
+private:
+    /** @class Memo
+        @brief evaluate fun once for each distinct argument
+    */
+    template<class F>
+    class Memo {
+    public:
+        Memo(const F& fun):m_fun(fun){}
+        double operator()(double costh)const
+        {
+            std::pair<std::map<Key,double>::iterator, bool> 
+                it(m_values.insert(std::make_pair(Key(costh, -1e30), 0.)));
+            if( it.second ) it.first->second = m_fun(costh);
+            return it.first->second;
+        }
+        double integral(double costh, double phi)const
+        {
+            std::pair<std::map<Key,double>::iterator, bool> 
+                it(m_values.insert(std::make_pair(Key(costh, phi), 0.)));
+            if( it.second ) it.first->second = m_fun.integral(costh, phi);
+            return it.first->second;
+        }
+    private:
+        typedef std::pair<double, double> Key;
+        const F& m_fun;
+        mutable std::map<Key, double> m_values;
+    };
+
+    std::vector<double> m_values;
+};
+
+} // namespace map_tools
+#endif
@@ -0,0 +1,89 @@
+/** @file ContentHash.h
+    @brief definition of the class ContentHash
+
+    $Header$
+*/
+#ifndef MAP_TOOLS_CONTENTHASH_H
+#define MAP_TOOLS_CONTENTHASH_H
+
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <stdint.h>
+#include <sys/stat.h>
+
+namespace map_tools {
+
+/**
+@class ContentHash
+@brief 64-bit FNV-1a hash of a sequence of strings, numbers and file contents, used as a cache key
+
+Each item is followed by a separator, so that "ab","c" and "a","bc" differ. It is not a
+cryptographic hash: it is meant to tell apart inputs, not to resist deliberate collisions.
+*/
+class ContentHash {
+public:
+    ContentHash(): m_hash(14695981039346656037ULL){}
+
+    //! add bytes
+    ContentHash& add(const char* data, size_t n)
+    {
+        for( size_t i=0; i<n; ++i){
+            m_hash ^= static_cast<unsigned char>(data[i]);
+            m_hash *= 1099511628211ULL;
+        }
+        return *this;
+    }
+    //! add a string, then a separator
+    ContentHash& add(const std::string& text)
+    {
+        add(text.data(), text.size());
+        return add("\n", 1);
+    }
+    //! add a number, in full precision
+    ContentHash& add(double x)
+    {
+        std::ostringstream text;
+        text << std::setprecision(17) << x;
+        return add(text.str());
+    }
+    //! add the contents of a file, then a separator
+    ContentHash& addFile(const std::string& filename)
+    {
+        std::ifstream in(filename.c_str(), std::ios::binary);
+        if( !in ) throw std::runtime_error("ContentHash: could not read "+filename);
+        char buffer[1<<16];
+        while( in.read(buffer, sizeof(buffer)) || in.gcount()>0 ){
+            add(buffer, static_cast<size_t>(in.gcount()));
+        }
+        return add("\n", 1);
+    }
+
+    /** @brief add the name, size and modification time of a file, to tell when it is replaced
+        without reading it. A missing file is added as such.
+    */
+    ContentHash& addFileStat(const std::string& filename)
+    {
+        add(filename);
+        struct stat info;
+        if( stat(filename.c_str(), &info)!=0 ) return add("missing");
+        return add(static_cast<double>(info.st_size)).add(static_cast<double>(info.st_mtime));
+    }
+
+    uint64_t value()const{return m_hash;}
+    //! the value as 16 hex digits
+    std::string str()const
+    {
+        std::ostringstream text;
+        text << std::hex << std::setw(16) << std::setfill('0') << m_hash;
+        return text.str();
+    }
+
+private:
+    uint64_t m_hash;
+};
+
+} // namespace map_tools
+#endif
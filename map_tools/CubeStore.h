@@ -0,0 +1,89 @@
+/** @file CubeStore.h
+    @brief definition of the class CubeStore
+
+    $Header$
+*/
+#ifndef MAP_TOOLS_CUBESTORE_H
+#define MAP_TOOLS_CUBESTORE_H
+
+#include "map_tools/Exposure.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+
+namespace tip { class Table; }
+
+namespace map_tools {
+
+/**
+@class CubeStore
+@brief A directory of exposure cubes at a fixed cadence, for the exposure of any time interval
+
+The store holds checkpoints at a fixed cadence: each is a file with the exposure cube and
+the livetime-weighted cube, as written by exposure_cube, for all the times since the first
+checkpoint, which is an empty cube that sets the binning. Since the float bins of a long sum
+would lose the precision of a short difference, each checkpoint also has a file of its bins
+and totals in double, with the extension ".sums". The exposure for [t1, t2] is the difference
+of the sums of two checkpoints, the first at or after t1 and the last at or before t2, plus
+a fill from the spacecraft table for the parts of the interval outside them: a query reads
+the same number of files however long the interval.
+
+The index, a text file "index.txt" in the directory, lists the time and file name of each
+checkpoint, one per line, in time order.
+*/
+class CubeStore {
+public:
+    //! open the store in a directory, reading its index if there is one
+    CubeStore(const std::string& directory);
+
+    /** @brief add checkpoints, at the given cadence, up to the end of a spacecraft table
+        @param scData the table, in time order
+        @param cadence time between checkpoints, in seconds
+        @param tstart time of the first checkpoint, an empty cube, if the store is empty
+        @param gti good-time intervals to apply, empty for all times
+        The binning of a new store is set by pixelsize, cosbinsize and zcut, as for Exposure;
+        otherwise it is that of the first checkpoint.
+    */
+    void update(const tip::Table * scData, double cadence, double tstart,
+        const Exposure::GTIvector& gti=Exposure::GTIvector(),
+        double pixelsize=1., double cosbinsize=1./healpix::CosineBinner::nbins(), double zcut=-1.0);
+
+    /** @brief the exposure for [t1, t2]
+        @param scData the spacecraft table, needed only if t1 or t2 is not a checkpoint time
+        @param exposure, weighted set to the exposure and livetime-weighted cubes
+    */
+    void query(double t1, double t2, const tip::Table * scData,
+        std::unique_ptr<Exposure>& exposure, std::unique_ptr<Exposure>& weighted)const;
+
+    //! number of checkpoints
+    size_t size()const{return m_times.size();}
+    //! time of checkpoint k
+    double time(size_t k)const{return m_times[k];}
+
+private:
+    /** @class Sums
+        @brief the bins of the cubes of a checkpoint, in pixel order, and their totals, in double
+    */
+    struct Sums {
+        Sums(): total(0), total2(0), lost(0), lost2(0){}
+        std::vector<double> exposure, weighted;
+        double total, total2, lost, lost2;
+    };
+
+    //! read the cubes of checkpoint k
+    void read(size_t k, std::unique_ptr<Exposure>& exposure, std::unique_ptr<Exposure>& weighted)const;
+    //! read the sums of checkpoint k
+    void read(size_t k, Sums& sums)const;
+    //! set exposure and weighted to checkpoint last less checkpoint first, an empty cube if they are the same
+    void difference(size_t first, size_t last, std::unique_ptr<Exposure>& exposure, std::unique_ptr<Exposure>& weighted)const;
+    //! write the cubes and their sums as a new checkpoint at time t, and rewrite the index
+    void write(double t, const Exposure& exposure, const Exposure& weighted, const Sums& sums);
+
+    std::string m_directory;
+    std::vector<double> m_times;
+    std::vector<std::string> m_files; ///< names relative to the directory
+};
+
+} // namespace map_tools
+#endif
@@ -11,6 +11,7 @@ $Header: /nfs/slac/g/glast/ground/cvs/users/burnett/tools/tools/DiffuseFunction.
 
 #include <vector>
 #include <cassert>
+#include <memory>
 #include <string>
 
 namespace map_tools {
@@ -20,6 +21,10 @@ class Aeff;    // forward declration for convolution with effective area
 /** @class DiffuseFunction
     @brief a SkyFunction that adapts a diffuse map. also computes extragal diffuse
 
+    The map is held read-only, and shared by copies. The value and integral member functions
+    take the energy as an argument and change nothing, so one object, or copies of it, can be
+    evaluated from several threads at once. setEnergy, setDirection, and the functors that use
+    them, keep the current energy and direction in the object, so are for one thread only.
 */
 
 class DiffuseFunction : public astro::SkyFunction {
@@ -33,9 +38,23 @@ public:
     */
     DiffuseFunction(std::string diffuse_cube_file, double egal_flux=1.5e-5, 
         double egal_index=2.1, double energy=1000.)
-        : m_data(diffuse_cube_file)
-        , m_egal_flux(egal_flux)
+        : m_egal_flux(egal_flux)
         , m_egal_index(egal_index)
+        , m_data(new map_tools::SkyImage(diffuse_cube_file))
+        , m_fract(0)
+        , m_emin(0), m_emax(0)
+    {
+        setEnergy(energy);
+    }
+
+    /** ctor that shares a map already loaded
+    @param data the diffuse cube, which must not be changed while it is shared
+    */
+    DiffuseFunction(std::shared_ptr<const map_tools::SkyImage> data, double egal_flux=1.5e-5, 
+        double egal_index=2.1, double energy=1000.)
+        : m_egal_flux(egal_flux)
+        , m_egal_index(egal_index)
+        , m_data(data)
         , m_fract(0)
         , m_emin(0), m_emax(0)
     {
@@ -72,9 +91,18 @@ public:
     /// functor for energy only (must set dirction)
     double operator()(double energy);
 
+    ///@return interpolation of the table for given direction and energy, without changing the object
+    double value(const astro::SkyDir& dir, double energy)const;
+
+    ///@return interpolation of the table for a pixel, as found by SkyImage::pixelIndex, and energy
+    double value(unsigned int pixel, double energy)const;
+
     ///@return integral for the energy limits, in the given direction
     double integral(const astro::SkyDir& dir, double a, double b)const;
 
+    ///@return integral for the energy limits, for a pixel as found by SkyImage::pixelIndex
+    double integral(unsigned int pixel, double a, double b)const;
+
 #if 1 // not implemented yet. 
     ///@return integral for the energy limits, over the function, in the given direction
     double integral(const astro::SkyDir& dir, const Aeff& f, double a, double b);
@@ -86,6 +114,7 @@ public:
         @param dir  direction 
         @param energies vector of the bin edges.
         @return result vector of the values
+        The direction is projected once, and the spectrum of its pixel read once for all the bins.
     */
     std::vector<double> integral(const astro::SkyDir& dir, 
         const std::vector<double>&energies)const;
@@ -94,6 +123,9 @@ public:
     /// @todo: get number from file
     int layers()const { return 17;}
 
+    /// @return the diffuse cube
+    const map_tools::SkyImage& image()const{ return *m_data;}
+
 
 private:
     static double s_emin;
@@ -105,7 +137,13 @@ private:
     static double h(double r, double alpha);
 
     static double energy_bin(int k);
-    map_tools::SkyImage m_data;
+    /// set the layer below e, and the fraction of the way to the next, for interpolation
+    void interpolation(double e, int& layer, double& fract)const;
+    /// @return the interpolation between layers k and k+1 of a pixel
+    double interpolate(unsigned int pixel, int k, double fract, double energy)const;
+    /// @return the integral from a to b of the power law through values vk, vkp of layers k, k+1
+    static double power_law_integral(int k, double vk, double vkp, double a, double b);
+    std::shared_ptr<const map_tools::SkyImage> m_data;
     int m_layer;
     double m_fract; ///< current fractional
     double m_emin, m_emax; ///< range for integral
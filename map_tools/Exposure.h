@@ -11,9 +11,13 @@
 #include "astro/SkyDir.h"
 #include "healpix/HealpixArray.h"
 #include "healpix/CosineBinner.h"
-namespace tip { class Table; class ConstTableRecord;}
+#include "map_tools/AlignedAllocator.h"
+#include "map_tools/GTIindex.h"
+namespace tip { class Table; }
 
 #include <utility> // for std::pair
+#include <vector>
+#include <functional>
 
 
 /** @class BasicExposure
@@ -48,6 +52,45 @@ public:
         const C& binner = m_sky[dir];
         return binner.integral(fun);
     }
+
+    //! as operator(), for the pixel with the given index in the pixelization; 0 for an index outside it
+    template<class F>
+        double exposure(long pix, const F& fun)const
+    {
+        return inside(pix)? (*(m_sky.begin()+pix))(fun) : 0;
+    }
+    /** @brief operator() for a set of pixels given by index, with no direction lookup
+        @param pix n indices in the pixelization; a negative or too large index gives 0
+        @param out set to the n values
+    */
+    template<class F>
+        void exposure(const long* pix, size_t n, const F& fun, double* out)const
+    {
+        for( size_t i=0; i<n; ++i){
+            out[i] = inside(pix[i])? (*(m_sky.begin()+pix[i]))(fun) : 0;
+        }
+    }
+    //! as integral(), for the pixel with the given index in the pixelization; 0 for an index outside it
+    template<class F>
+        double integral(long pix, const F& fun)const
+    {
+        return inside(pix)? (*(m_sky.begin()+pix)).integral(fun) : 0;
+    }
+    //! integral() for a set of pixels given by index, as exposure(pix, n, fun, out)
+    template<class F>
+        void integral(const long* pix, size_t n, const F& fun, double* out)const
+    {
+        for( size_t i=0; i<n; ++i){
+            out[i] = inside(pix[i])? (*(m_sky.begin()+pix[i])).integral(fun) : 0;
+        }
+    }
+    //! operator() for a set of directions
+    template<class F>
+        void exposure(const std::vector<astro::SkyDir>& dirs, const F& fun, std::vector<double>& out)const
+    {
+        out.resize(dirs.size());
+        for( size_t i=0; i<dirs.size(); ++i) out[i] = m_sky[dirs[i]](fun);
+    }
     const S& data()const{return m_sky;}
     S& data(){return m_sky;}
     double total()const{return m_total;}
@@ -55,6 +98,8 @@ public:
 
     void setData(const S& data){m_sky=data;}
 private:
+    //! true if pix is the index of a pixel of the pixelization
+    bool inside(long pix)const{ return pix>=0 && static_cast<size_t>(pix)<m_sky.size();}
     S m_sky;
     double m_total;
 };
@@ -65,6 +110,9 @@ typedef BasicExposure<SkyBinner, healpix::CosineBinner> SkyExposure;
 
 namespace map_tools {
 
+class PointingColumns;
+class WorkerPool;
+
 /**
 @class Exposure
 @brief Manage a differential exposure database.
@@ -95,20 +143,67 @@ public:
     */
     virtual void fill(const astro::SkyDir& dirz, const astro::SkyDir& dirzenith, double deltat);
 
-    //! create object from the data file (FITS for now)
+    /** @brief create object from the data file (FITS for now)
+        The zenith cuts, and the times already included if the file has a GTI extension, are
+        restored, so that load adds only new rows to it.
+    */
     Exposure(const std::string& inputfile, const std::string& tablename="Exposure");
 
-    //! write out to a file.
-    void write(const std::string& outputfile, const std::string& tablename="Exposure")const;
+    /** @brief write out to a file, with the zenith cuts and time range as header keywords
+        @param clobber [true] replace the file; false to add the table to it
+    */
+    void write(const std::string& outputfile, const std::string& tablename="Exposure", bool clobber=true)const;
+
+    //! append the times included in the cube to a file, as a GTI extension marked with EXPCOVER = T
+    void writeCoverage(const std::string& outputfile, const std::string& tablename="GTI")const;
 
-    typedef std::vector<std::pair<double, double> > GTIvector;
+    typedef GTIindex::GTIvector GTIvector;
 
-    //! load a set of history intervals from a table, qualified by a set of "good-time" intervals 
+    /** @brief load a set of history intervals from a table, qualified by a set of "good-time" intervals 
+        @param gti the intervals, in any order: those from several files may be concatenated
+        Times that are already included, by an earlier load or in the file this was read from,
+        are skipped, so a cube can be brought up to date with the rows added to a table.
+    */
     void load(const tip::Table * scData, 
         const GTIvector & gti= GTIvector(), 
                     bool verbose=true);
 
+    /** @brief load this exposure, and a livetime-weighted one, in a single pass over the table
+        @param weighted an Exposure with the same binning, which accumulates deltat*livetime/(stop-start)
+        The geometry of each pixel is computed once, and both sets of bins are filled from it.
+        The times loaded are added to the coverage of both.
+    */
+    void load(const tip::Table * scData, Exposure& weighted,
+        const GTIvector & gti= GTIvector(), 
+                    bool verbose=true);
+
     double lost()const{return m_lost;}
+    void addlost(double t){ m_lost+=t;}
+
+    //! the minimum cos(zenith angle) cut, -1 if none
+    double zcut()const{return m_zcut;}
+
+    /** @brief check that the rows of a table can be added to this cube, read from a file, by load
+        @param cosbinsize, zcut the settings of the new rows, as for the constructor
+        @throw std::invalid_argument if the binning or the zenith cut differ, or if the file has
+        no record of the cuts or of the times it includes: load would then add them again
+    */
+    void checkAppend(double cosbinsize, double zcut)const;
+
+    //! the times included in the cube, sorted and merged
+    const GTIvector& coverage()const{return m_coverage.intervals();}
+    //! replace the times included in the cube, for example after subtract
+    void setCoverage(const GTIvector& gti){m_coverage=GTIindex(gti);}
+
+    //! subtract the contents of another Exposure with the same binning, such as an earlier state of this one
+    void subtract(const Exposure& other);
+
+    /** @brief set the number of threads used to fill the pixels
+        @param nthreads number of threads: each one fills its own contiguous range of pixels. 
+        0 or 1 means fill serially in the calling thread.
+    */
+    void setThreads(unsigned int nthreads){m_nthreads=nthreads;}
+    unsigned int threads()const{return m_nthreads;}
 
     /** @brief  allow horizon cut, possible if FOV includes horizon
         @param dirz direction of z-axis of instrument
@@ -120,14 +215,94 @@ public:
     virtual void fill_zenith(const astro::SkyDir& dirz,const astro::SkyDir& dirx, 
         const astro::SkyDir& dirzenith, double deltat);
 
+    /** @class PointingRow
+        @brief one interval of the pointing history, as needed by fill_zenith
+    */
+    class PointingRow {
+    public:
+        PointingRow(const astro::SkyDir& z, const astro::SkyDir& x, const astro::SkyDir& zen, double dt, double wdt=0)
+            : dirz(z), dirx(x), zenith(zen), deltat(dt), wdeltat(wdt){}
+        astro::SkyDir dirz;   ///< direction of z-axis of instrument
+        astro::SkyDir dirx;   ///< direction of x-axis of instrument
+        astro::SkyDir zenith; ///< direction of local zenith
+        double deltat;        ///< time interval
+        double wdeltat;       ///< time interval for a weighted exposure, if any
+    };
+
+    /** @brief equivalent to fill_zenith for each row, in order, but cache friendly
+        The pixels are processed in tiles, small enough to stay in the L2 cache while all the
+        rows are applied to them, so the sky is streamed through memory once per batch
+        rather than once per row.
+        @param weighted if set, an Exposure with the same binning to which the wdeltat
+        of each row is added at the same time
+    */
+    void fill_batch(const std::vector<PointingRow>& rows, Exposure* weighted=0);
+
+    /** @brief set the number of rows that load passes to fill_batch at a time
+        @param rows number of rows per batch. The default, 1, calls fill_zenith for each row,
+        which a subclass may override.
+    */
+    void setBatchSize(size_t rows){m_batchsize=rows;}
+    size_t batchSize()const{return m_batchsize;}
+
+    /** @brief set the number of pixels in a tile for fill_batch
+        @param pixels number of pixels, 0 [default] to size the tile for a 256 kB cache
+    */
+    void setTileSize(size_t pixels){m_tilesize=pixels;}
+
+    /** @brief enable or disable pruning [default enabled]
+        When enabled, blocks of the nested pixel hierarchy that are entirely outside the field
+        of view, or entirely below the zenith cut, are accounted for without visiting their
+        pixels. The cube is the same either way.
+    */
+    void setPruning(bool prune){m_prune=prune;}
+
+    /** @brief set the grid step for combining rows of nearly the same orientation in load
+        @param degrees step, in degrees, of the grid in each component of the z-axis, x-axis and
+        zenith directions. 0 [default] fills each row separately. Otherwise the rows in each
+        occupied cell are filled once, with their summed time; see PointingGrid for the error bound.
+    */
+    void setAggregation(double degrees){m_aggregation=degrees;}
+    double aggregation()const{return m_aggregation;}
+
+    //! @return the number of rows that the last aggregated load combined
+    size_t aggregatedRows()const{return m_aggregated_rows;}
+    //! @return the number of cells that the last aggregated load filled
+    size_t aggregatedCells()const{return m_aggregated_cells;}
+
+    /** @brief set the number of blocks of rows that load may read ahead of the fill
+        @param blocks 0 [default] reads and fills in turn. Otherwise a reader thread decodes the
+        table, in blocks of the batch size, into a queue of this depth, while the calling thread
+        fills; the reader waits when the queue is full.
+    */
+    void setQueueDepth(size_t blocks){m_queuedepth=blocks;}
+    size_t queueDepth()const{return m_queuedepth;}
+
 private:
-    bool processEntry(const tip::ConstTableRecord & row, const GTIvector& gti);
+    //! read the zenith cuts and the GTI extension written by write and writeCoverage, if present:
+    //! a GTI extension without the EXPCOVER keyword is not coverage, and is ignored
+    void readCoverage(const std::string& inputfile, const std::string& tablename);
+
+    //! add row i of the block to rows if it overlaps the GTIs. @return true if past the last GTI
+    bool processEntry(const PointingColumns& block, size_t i, GTIindex& gti, std::vector<PointingRow>& rows);
+
+    /** @brief read the table, passing the accepted rows to deliver in blocks of the batch size
+        @param deliver called with each block; it may swap the contents, and return false to stop
+    */
+    void read(const tip::Table * scData, GTIindex& gti, bool verbose,
+        const std::function<bool(std::vector<PointingRow>&)>& deliver);
+
+    //! fill a block of rows, as fill_zenith or fill_batch according to the batch size
+    void fill_rows(const std::vector<PointingRow>& rows);
 
     /** @brief set up the cache of vectors associated with cosine histograms
 
     */
     void create_cache();
 
+    //! add a level of blocks of the given number of pixels to the pixel hierarchy
+    void add_level(size_t blocksize);
+
         /** @class Simple3Vector 
     @brief replacement for Hep3Vector for speed of dot product
 
@@ -146,13 +321,66 @@ private:
         }
         double x,y,z;
     };
-    std::vector< std::pair<healpix::CosineBinner* ,  Simple3Vector> > m_dir_cache;
+
+    /** @class DirCache
+        @brief structure-of-arrays cache of the pixel directions, so that the fill kernels can vectorize
+
+        The x, y and z arrays are 64-byte aligned; bins and binner are parallel to them.
+    */
+    class DirCache {
+    public:
+        typedef std::vector<double, AlignedAllocator<double> > Array;
+        Array x, y, z; ///< components of the pixel directions
+        std::vector<float*> bins; ///< start of the bin contents of each pixel
+        std::vector<healpix::CosineBinner*> binner; ///< the binner for each pixel
+        size_t size()const{return binner.size();}
+
+        /** @class Level
+            @brief one level of the nested pixel hierarchy: each block is a contiguous range of
+            pixels, with a cone that contains all their directions
+        */
+        class Level {
+        public:
+            size_t size;         ///< number of pixels per block
+            Array cx, cy, cz;    ///< direction of the center of each block
+            Array cosr, sinr;    ///< cosine and sine of the angular radius of each block
+        };
+        std::vector<Level> levels; ///< coarse to fine, empty if not nested
+    };
+    DirCache m_dir_cache;
     class Filler ; ///< class used to fill a CosineBinner object with a value
 
+    /** @brief apply each Filler, in order, to every pixel in the cache
+        Pixels are split over m_nthreads threads, and processed in tiles of m_tilesize pixels.
+        During load the threads are those of its pool; otherwise they are started for the call.
+        On return each Filler has its total and lost summed over all the pixels.
+    */
+    void apply(std::vector<Filler>& fillers);
+
+    //! apply a single Filler to every pixel in the cache
+    Filler apply(const Filler& filler);
+
+    //! apply the fillers to the pixels [first, last), one tile at a time
+    void fill_tiles(std::vector<Filler>& fillers, size_t first, size_t last)const;
+
+    //! @return the number of pixels in a tile, allowing for bins in a second exposure if set
+    size_t tile_size(bool second=false)const;
+
     double m_zcut; ///< value for zenith angle cut
    double m_zmaxcut;
     double m_lost; ///< keep track of lost
     bool   m_weighted; ///< true if accumulating weighted livetime
+    unsigned int m_nthreads; ///< number of threads to use for filling
+    size_t m_batchsize; ///< number of rows for load to pass to fill_batch
+    size_t m_tilesize;  ///< number of pixels in a fill_batch tile, 0 for automatic
+    Exposure* m_companion; ///< weighted exposure filled along with this one by load, if any
+    WorkerPool* m_pool;    ///< fill threads kept by load while it runs, if threaded
+    bool m_prune; ///< skip blocks of pixels outside the cuts
+    double m_aggregation; ///< grid step for combining rows in load, 0 for none
+    size_t m_aggregated_rows, m_aggregated_cells; ///< result of the last aggregated load
+    GTIindex m_coverage; ///< the times included in the cube
+    bool m_recorded; ///< false if read from a file without the cut keywords
+    size_t m_queuedepth; ///< number of blocks of rows that load reads ahead, 0 to read and fill in turn
 };
 
 
@@ -0,0 +1,100 @@
+/** @file ExposureSeries.h
+    @brief definition of the class ExposureSeries
+
+    $Header$
+*/
+#ifndef MAP_TOOLS_EXPOSURESERIES_H
+#define MAP_TOOLS_EXPOSURESERIES_H
+
+#include "map_tools/Exposure.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+
+namespace tip { class Table; }
+
+namespace map_tools {
+
+/**
+@class ExposureSeries
+@brief A set of exposure cubes, one per time bin, filled in a single pass over a spacecraft table
+
+Each row of the table is split at the bin edges, and each part is added, with its share of
+the livetime, to the cube of its bin: an Exposure and a livetime-weighted companion, as made
+by exposure_cube. The rows are in time order, so a bin is finished once the rows have passed
+its end. Finished bins are written to the output file, in order, as soon as more than a
+given number of them are held, so a series of hundreds of bins needs only a few resident cubes.
+
+The cubes for bin k are written to the tables <tablename>_<k> and <tablename2>_<k>, with the
+bin edges as the TSTART and TSTOP keywords.
+*/
+class ExposureSeries {
+public:
+    /** @brief ctor
+        @param edges the bin edges, increasing: there are edges.size()-1 bins
+        @param outputfile the file the cubes are written to; it is replaced
+        @param pixelsize, cosbinsize, zcut as for Exposure
+        @param maxcubes number of finished bins kept in memory before they are written
+    */
+    ExposureSeries(const std::vector<double>& edges, const std::string& outputfile,
+        double pixelsize=1., double cosbinsize=1./healpix::CosineBinner::nbins(), double zcut=-1.0,
+        size_t maxcubes=1);
+
+    //! set the names of the tables, before the bin number is appended
+    void setTableNames(const std::string& tablename, const std::string& tablename2)
+    { m_tablename=tablename; m_tablename2=tablename2; }
+
+    //! as the Exposure setting, applied to the cube of each bin
+    void setThreads(unsigned int nthreads){m_nthreads=nthreads;}
+    //! number of rows of a bin passed to Exposure::fill_batch at a time: 1 [default] for each in turn
+    void setBatchSize(size_t rows){m_batchsize=rows;}
+
+    /** @brief fill the bins from the rows of a table, qualified by a set of good-time intervals
+        @param gti the intervals, in any order; empty for all times
+    */
+    void load(const tip::Table * scData, const Exposure::GTIvector& gti=Exposure::GTIvector());
+
+    //! write the bins not yet written, including any that no row reached
+    void finish();
+
+    size_t size()const{return m_bins.size();}
+    //! time added to all the bins, after the zenith cut, as for Exposure::total
+    double total()const{return m_total;}
+    //! number of bins written so far
+    size_t written()const{return m_written;}
+
+private:
+    /** @class Bin
+        @brief the cubes of one time bin, made when a row first reaches it
+    */
+    class Bin {
+    public:
+        Bin(double a, double b): start(a), stop(b), finished(false){}
+        double start, stop;
+        std::unique_ptr<Exposure> ex, ex2;
+        std::vector<Exposure::PointingRow> rows; ///< waiting to be filled
+        bool finished;
+    };
+
+    //! make the cubes of a bin if necessary
+    void create(Bin& bin);
+    //! fill the rows waiting in a bin
+    void flush(Bin& bin);
+    //! flush a bin and mark it finished, then write finished bins beyond maxcubes
+    void close(size_t k);
+    //! write the cubes of bin k, and free them
+    void write(size_t k);
+
+    std::vector<Bin> m_bins;
+    std::string m_outputfile, m_tablename, m_tablename2;
+    double m_pixelsize, m_cosbinsize, m_zcut;
+    size_t m_maxcubes;
+    unsigned int m_nthreads;
+    size_t m_batchsize;
+    size_t m_written;  ///< bins [0, m_written) have been written
+    double m_total;
+};
+
+} // namespace map_tools
+#endif
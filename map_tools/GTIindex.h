@@ -0,0 +1,63 @@
+/** @file GTIindex.h
+    @brief definition of the class GTIindex
+
+    $Header$
+*/
+#ifndef MAP_TOOLS_GTIINDEX_H
+#define MAP_TOOLS_GTIINDEX_H
+
+#include <vector>
+#include <utility> // for std::pair
+#include <cstddef>
+
+namespace map_tools {
+
+/**
+@class GTIindex
+@brief Sorted, merged set of good-time intervals, with a cursor for time-ordered queries
+
+The intervals are sorted and overlapping ones merged, so a list concatenated from the GTI
+extensions of several FT1 files may be used directly. The cursor follows a sequence of
+time-ordered queries, so each one costs amortized O(1); a query that goes backwards in
+time falls back to a binary search.
+*/
+class GTIindex {
+public:
+    typedef std::vector<std::pair<double, double> > GTIvector;
+
+    //! @param gti list of (start, stop) intervals, in any order, possibly overlapping
+    GTIindex(const GTIvector& gti=GTIvector());
+
+    //! merge in more intervals, for example from another FT1 file
+    void add(const GTIvector& gti);
+
+    /** @brief fraction of the interval [start, stop] that is inside the good-time intervals
+        @return 1 if there are no intervals
+    */
+    double fraction(double start, double stop);
+
+    //! @return true if time is later than the end of the last interval
+    bool after(double time)const{return !m_gti.empty() && time > m_gti.back().second;}
+
+    bool empty()const{return m_gti.empty();}
+    size_t size()const{return m_gti.size();}
+
+    //! the sorted and merged intervals
+    const GTIvector& intervals()const{return m_gti;}
+
+    //! @return the parts of the given intervals that are not inside these ones, sorted and merged
+    GTIvector subtract(const GTIvector& gti)const;
+
+    //! @return these intervals, clipped to [start, stop]
+    GTIvector clip(double start, double stop)const;
+
+private:
+    //! sort and merge m_gti, and reset the cursor
+    void merge();
+
+    GTIvector m_gti; ///< sorted, non-overlapping intervals
+    size_t m_cursor; ///< first interval that does not end before the previous query started
+};
+
+} // namespace map_tools
+#endif
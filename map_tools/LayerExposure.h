@@ -0,0 +1,58 @@
+/** @file LayerExposure.h
+    @brief definition of the class LayerExposure
+
+    $Header$
+*/
+#ifndef MAP_TOOLS_LAYEREXPOSURE_H
+#define MAP_TOOLS_LAYEREXPOSURE_H
+
+#include "map_tools/SkyImage.h"
+#include "map_tools/Exposure.h"
+#include "map_tools/BinnerTable.h"
+#include "map_tools/AlignedAllocator.h"
+
+#include <vector>
+
+namespace map_tools {
+
+/**
+@class LayerExposure
+@brief the exposure for all the layers of an image, as a matrix product
+
+With the effective area for each layer tabulated over the bins of the cube, by a BinnerTable,
+the exposures of a set of directions for all layers are the product of a matrix with the bin
+contents of each direction as rows, and one with the table of each layer as columns. Each
+block of directions is evaluated in one pass over the bins, rather than once per layer.
+*/
+class LayerExposure : public SkyImage::LayerFunction {
+public:
+    /** @brief ctor
+        @param exp the exposure cube, which must outlive this object
+        @param aeff the effective area of each layer, tabulated for the binning of exp
+        @param norm [1] factor applied to all values
+    */
+    LayerExposure(const Exposure& exp, const std::vector<BinnerTable>& aeff, double norm=1.0);
+
+    virtual size_t layers()const{return m_layers;}
+
+    //! values[i*layers()+k] is the exposure in direction i for layer k
+    virtual void operator()(const std::vector<astro::SkyDir>& dirs, std::vector<double>& values)const;
+
+    //! the pixelization of the cube, so that an image can pass pixel indices
+    virtual const healpix::Healpix* pixelization()const{return &m_exp.data().healpix();}
+
+    //! values[i*layers()+k] is the exposure in pixel pix[i] of the cube for layer k
+    virtual void operator()(const std::vector<long>& pix, std::vector<double>& values)const;
+
+private:
+    //! the product for the bin contents in rows
+    void product(const std::vector<const float*>& rows, std::vector<double>& values)const;
+
+    const Exposure& m_exp;
+    size_t m_layers; ///< number of columns of the table
+    size_t m_bins;   ///< number of rows of the table
+    std::vector<double, AlignedAllocator<double> > m_table; ///< coefficient of bin j for layer k at j*m_layers+k
+};
+
+} // namespace map_tools
+#endif
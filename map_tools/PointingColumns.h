@@ -0,0 +1,68 @@
+/** @file PointingColumns.h
+    @brief definition of the class PointingColumns
+
+    $Header$
+*/
+#ifndef MAP_TOOLS_POINTINGCOLUMNS_H
+#define MAP_TOOLS_POINTINGCOLUMNS_H
+
+#include <vector>
+#include <cstddef>
+
+namespace tip { class Table; class IColumn; }
+
+namespace map_tools {
+
+/**
+@class PointingColumns
+@brief A block of rows of a spacecraft (FT2) table, as a structure of arrays
+
+The columns that Exposure needs are looked up by name once, rather than for every field of
+every row. A block of rows is then copied from each column into a contiguous array, one
+value per call to the tip column, so the cost of a tip call for each value remains. The
+RA and Dec of the z-axis, x-axis and zenith are converted to unit vectors in one pass over
+each block.
+*/
+class PointingColumns {
+public:
+    //! @param table the spacecraft table: it must outlive this object
+    PointingColumns(const tip::Table * table);
+
+    /** @brief read a block of rows
+        @param first index of the first row
+        @param count number of rows to read, fewer if the table ends first
+        @return the number of rows read, which is size()
+    */
+    size_t read(long first, size_t count);
+
+    //! number of rows in the current block
+    size_t size()const{return start.size();}
+    //! number of rows in the table
+    long rows()const{return m_rows;}
+
+    //! @return index of the first row that stops after time, by binary search: the rows must be in time order
+    long find(double time)const;
+
+    //! @return false if the table is empty; otherwise the start of the first row and the stop of the last
+    bool span(double& tstart, double& tstop)const;
+
+    std::vector<double> start, stop, livetime;
+    std::vector<double> zx, zy, zz; ///< unit vector of the z-axis
+    std::vector<double> xx, xy, xz; ///< unit vector of the x-axis
+    std::vector<double> nx, ny, nz; ///< unit vector of the local zenith
+
+private:
+    //! read a column of the block into values, a record at a time
+    void get(int column, long first, size_t count, std::vector<double>& values)const;
+
+    //! convert the ra and dec arrays, in degrees, to unit vectors
+    void convert(std::vector<double>& x, std::vector<double>& y, std::vector<double>& z)const;
+
+    enum {START, STOP, LIVETIME, RA_SCZ, DEC_SCZ, RA_SCX, DEC_SCX, RA_ZENITH, DEC_ZENITH, NCOLUMNS};
+    const tip::IColumn * m_columns[NCOLUMNS];
+    long m_rows;
+    mutable std::vector<double> m_ra, m_dec; ///< scratch arrays, in degrees
+};
+
+} // namespace map_tools
+#endif
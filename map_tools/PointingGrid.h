@@ -0,0 +1,80 @@
+/** @file PointingGrid.h
+    @brief definition of the class PointingGrid
+
+    $Header$
+*/
+#ifndef MAP_TOOLS_POINTINGGRID_H
+#define MAP_TOOLS_POINTINGGRID_H
+
+#include "map_tools/Exposure.h"
+
+#include <vector>
+#include <cstddef>
+#include <unordered_map>
+
+namespace map_tools {
+
+/**
+@class PointingGrid
+@brief Combine pointing history rows with nearly the same orientation
+
+Each of the three unit vectors of a row, the z-axis, x-axis and zenith directions, is
+quantized on a cubic grid with the given step in each component. Rows that fall in the
+same cell have their times summed, and are replaced by a single row with the
+time-weighted mean directions. The cells are kept in the order they were first occupied.
+
+A direction can be moved by at most the diagonal of a cell, sqrt(3) times the step, so
+cos(theta) and cos(zenith angle) of every pixel change by less than sqrt(3)*step (in
+radians). With a step of 0.1 deg that is 0.003, much less than a 0.025 cos(theta) bin.
+*/
+class PointingGrid {
+public:
+    typedef Exposure::PointingRow PointingRow;
+
+    //! @param degrees grid step, in degrees
+    PointingGrid(double degrees);
+
+    //! add the time of a row to its cell
+    void add(const PointingRow& row);
+
+    //! @return one row per occupied cell
+    std::vector<PointingRow> rows()const;
+
+    //! number of rows added
+    size_t added()const{return m_added;}
+    //! number of occupied cells
+    size_t size()const{return m_cells.size();}
+
+private:
+    /** @class Key
+        @brief the quantized components of the three directions
+    */
+    class Key {
+    public:
+        long k[9];
+        bool operator==(const Key& other)const;
+    };
+    class KeyHash {
+    public:
+        size_t operator()(const Key& key)const;
+    };
+    /** @class Cell
+        @brief time-weighted sums of the directions of the rows in a cell
+    */
+    class Cell {
+    public:
+        Cell():deltat(0), wdeltat(0){}
+        CLHEP::Hep3Vector z, x, zenith;
+        double deltat, wdeltat;
+    };
+    //! set three elements of the key, starting at first, from a direction
+    void quantize(const CLHEP::Hep3Vector& dir, Key& key, int first)const;
+
+    double m_step; ///< grid step in each component of a unit vector
+    std::unordered_map<Key, size_t, KeyHash> m_index; ///< index into m_cells
+    std::vector<Cell> m_cells;
+    size_t m_added;
+};
+
+} // namespace map_tools
+#endif
@@ -0,0 +1,58 @@
+/** @file ResultStore.h
+    @brief definition of the class ResultStore
+
+    $Header$
+*/
+#ifndef MAP_TOOLS_RESULTSTORE_H
+#define MAP_TOOLS_RESULTSTORE_H
+
+#include <string>
+
+namespace map_tools {
+
+/**
+@class ResultStore
+@brief A directory of output files, saved by a key made from all the inputs that produced them
+
+A tool that finds its key in the store can provide the saved file instead of computing it:
+it is copied to the output name, or, if the store was opened to link, hard-linked to it, with
+a copy if that is on another file system. Saved files are made read-only, so a linked output,
+which is the saved file itself, is read-only too: it must not be modified in place.
+
+The store is limited in size: after a file is saved, the least recently used files, by
+modification time, which fetch updates, are removed until the total is within the limit.
+*/
+class ResultStore {
+public:
+    /** @brief use the directory, creating it if needed
+        @param maxsize limit on the total size of the saved files, in bytes
+        @param link [false] hard-link, rather than copy, a saved file to the output
+    */
+    ResultStore(const std::string& directory, double maxsize, bool link=false);
+
+    /** @brief provide the file saved for key as outfile
+        @param clobber [true] replace outfile if it exists; if false, an existing outfile is left alone
+        @return false if there is no file for the key, or outfile exists and is not to be replaced
+    */
+    bool fetch(const std::string& key, const std::string& outfile, bool clobber=true)const;
+
+    //! save a copy of file for key, then remove the least recently used files over the limit
+    void save(const std::string& key, const std::string& file)const;
+
+    //! total size of the saved files, in bytes
+    double size()const;
+
+    //! the saved file for a key
+    std::string path(const std::string& key)const;
+
+private:
+    //! remove the least recently used files until the total is within the limit
+    void evict()const;
+
+    std::string m_directory;
+    double m_maxsize;
+    bool m_link;
+};
+
+} // namespace map_tools
+#endif
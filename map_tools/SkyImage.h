@@ -15,11 +15,16 @@
 
 #include <string>
 #include <vector>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 
 // forward declarations of classes involved in implementaion
 namespace tip   { class ImageBase; }
 namespace astro { class SkyProj; }
 namespace hoops { class IParGroup; }
+namespace healpix { class Healpix; }
 
 namespace map_tools {
 /**
@@ -56,14 +61,21 @@ public:
     */
     SkyImage(const hoops::IParGroup& pars);
 
+    /** @brief order of the pixel values in memory
+        LAYER_MAJOR keeps each layer as a plane, as in the FITS file. PIXEL_MAJOR keeps the
+        values of the layers of each pixel together, for reading the spectrum of a pixel.
+    */
+    enum Layout {LAYER_MAJOR, PIXEL_MAJOR};
+
     /** @brief load an image from a file.
         @param filename name of the file, only FITS for now
         @param extension Name of an extension: if blank, assume primary
-
+        @param layout [LAYER_MAJOR] order of the values in memory: the image is transposed
+               as it is read for PIXEL_MAJOR, and back if it is written.
     */
 
     
-    SkyImage(const std::string& filename, const std::string& extension="");
+    SkyImage(const std::string& filename, const std::string& extension="", Layout layout=LAYER_MAJOR);
 
     /** @brief create an image, using the projection
         @param center coords of image center
@@ -103,6 +115,11 @@ public:
  
     void getEnergies(std::vector<double> & energy) const { energy = m_energy; }
 
+    /** @brief the energies of the layers that the constructor from parameters would make
+        @param pars the cmfile and bincalc parameters; emin, emax and enumbins if cmfile is NONE
+    */
+    static std::vector<double> energies(const hoops::IParGroup& pars);
+
     /**
     @brief loop over all internal bins, request the intensity from a functor derived
     from SkyFunction
@@ -111,6 +128,93 @@ public:
     */
     void fill( const astro::SkyFunction& req, unsigned int layer=0);
 
+    /** @class LayerFunction
+        @brief a function over the sky with a value for each layer, evaluated for a block of
+        directions at a time
+    */
+    class LayerFunction {
+    public:
+        virtual ~LayerFunction(){}
+        //! number of values for each direction
+        virtual size_t layers()const=0;
+        /** @param dirs the directions
+            @param values set to dirs.size()*layers() values: values[i*layers()+k] for direction i, layer k
+        */
+        virtual void operator()(const std::vector<astro::SkyDir>& dirs, std::vector<double>& values)const=0;
+
+        /** @return a HEALPix pixelization if the values depend only on the pixel of it that
+            contains the direction, so that fill can pass the pixel indices instead, or 0 [default]
+        */
+        virtual const healpix::Healpix* pixelization()const{return 0;}
+        /** @param pix indices in pixelization() 
+            @param values set to pix.size()*layers() values, as for a set of directions
+        */
+        virtual void operator()(const std::vector<long>& /*pix*/, std::vector<double>& /*values*/)const
+        {
+            throw std::logic_error("SkyImage::LayerFunction: no pixelization");
+        }
+    };
+
+    /**
+    @brief fill every layer in one sweep over the image, requesting the values a row at a time
+    @param req a functor with a value for each layer of the image
+    */
+    void fill( const LayerFunction& req);
+
+    /** @class Statistics
+        @brief summary of the values set in a layer by fill
+    */
+    class Statistics {
+    public:
+        Statistics(): total(0), sumsq(0), count(0), min(1e20), max(-1e10){}
+        void add(double t){
+            total += t; sumsq += t*t; ++count;
+            min = t<min? t:min;
+            max = t>max? t:max;
+        }
+        //! combine with the statistics of other values
+        void merge(const Statistics& other){
+            total += other.total; sumsq += other.sumsq; count += other.count;
+            min = other.min<min? other.min:min;
+            max = other.max>max? other.max:max;
+        }
+        double total, sumsq, count, min, max;
+    };
+
+    //! @return the statistics of the last fill of a layer
+    const Statistics& statistics(unsigned int layer)const;
+
+    /** @class Geometry
+        @brief the directions of the pixel centers of one layer, which fill reuses for every layer
+    */
+    class Geometry {
+    public:
+        std::vector<bool> valid;     ///< true for the pixels inside the projection
+        std::vector<double> x, y, z; ///< equatorial unit vector of each valid pixel center
+        std::vector<long> index;     ///< HEALPix index of each valid pixel center, -1 for the others, if set
+        long nside;                  ///< of the pixelization of index, 0 if not set
+        bool nested;                 ///< ordering of the pixelization of index
+        //! direction of pixel k, if valid
+        astro::SkyDir dir(size_t k)const{ return astro::SkyDir(CLHEP::Hep3Vector(x[k], y[k], z[k])); }
+    };
+
+    //! @return the geometry of the image, made by the projection on the first call, which may be from any thread
+    const Geometry& geometry()const;
+
+    /** @return the geometry of the image, with the HEALPix index of each pixel for hp
+        The indices are found again only if the nside or ordering differ from the last call,
+        so concurrent calls must use the same pixelization.
+    */
+    const Geometry& geometry(const healpix::Healpix& hp)const;
+
+    /** @brief set the number of threads used by fill
+        @param nthreads each thread fills a contiguous range of rows, with its own statistics,
+        which are merged in row order. 0 or 1 [default] fills serially in the calling thread.
+        The function that fill requests must then be safe to call from several threads at once.
+    */
+    void setThreads(unsigned int nthreads){m_nthreads=nthreads;}
+    unsigned int threads()const{return m_nthreads;}
+
     /** brief clear the image, putting nulls around a AIT map
     */
     void clear();
@@ -127,6 +231,27 @@ public:
         @return value of the pixel corresponding to the given direction
     */
     double pixelValue(const astro::SkyDir& pos, unsigned int layer=0)const;
+
+    /** @brief the pixel at a direction, as an index within a layer, so that the values of
+        several layers can be read with one projection
+        @param pos position in the sky
+    */
+    unsigned int pixelIndex(const astro::SkyDir& pos)const;
+
+    /** @brief get value of a pixel given by pixelIndex
+        @param index of the pixel within a layer
+        @param layer number
+    */
+    double layerValue(unsigned int index, unsigned int layer)const;
+
+    /** @brief get the values of a pixel given by pixelIndex in a range of layers, stepping
+        through the cube by the size of a layer
+        @param index of the pixel within a layer
+        @param first layer
+        @param count number of layers
+        @param values set to the count values
+    */
+    void layerValues(unsigned int index, unsigned int first, unsigned int count, double* values)const;
     
     /** @brief  set a list of the neighbor values
     @param pos position in the sky
@@ -142,19 +267,48 @@ public:
     /// @brief access to number of layers
     int layers()const{return m_naxis3;}
 
+    /// @return the order of the values in memory
+    Layout layout()const{return m_layout;}
+
+    /// @brief change the order of the values in memory, transposing them. They are always
+    /// written in plane order.
+    void setLayout(Layout layout);
+
 private:
     void setupImage(const std::string& outputFile,  bool clobber=true);
     //! @brief internal routine to convert SkyDir to pixel index
     unsigned int pixel_index(const astro::SkyDir& pos, int layer=-1) const;
+    //! @brief internal routine to convert SkyDir to the index of its pixel within a layer
+    unsigned int plane_index(const astro::SkyDir& pos) const;
 
     /// @brief internal routine to check layer, or perhaps extend
     void checkLayer(unsigned int layer)const;
 
+    //! fill rows [first, last) of a layer, adding to stats
+    void fill_rows(const astro::SkyFunction& req, unsigned int layer, int first, int last, Statistics& stats);
+    //! fill rows [first, last) of every layer, adding to stats for each layer
+    void fill_rows(const LayerFunction& req, int first, int last, std::vector<Statistics>& stats);
+    //! call fill(first, last, i) for contiguous ranges of rows, over the threads i
+    void for_rows(const std::function<void(int, int, size_t)>& fill)const;
+    //! make m_geometry if not yet made, with m_geometryMutex held
+    Geometry& make_geometry()const;
+
+    //! @return the position in m_imageData of a pixel, given by its index within a layer, in a layer
+    size_t offset(size_t pixel, unsigned int layer)const{
+        return m_layout==PIXEL_MAJOR? pixel*m_naxis3+layer : pixel+layer*size_t(m_naxis1*m_naxis2);
+    }
+    //! @return the distance in m_imageData between the values of a pixel in successive layers
+    size_t layerStride()const{ return m_layout==PIXEL_MAJOR? 1 : size_t(m_naxis1*m_naxis2);}
+    //! copy data, from plane order if to_pixel_major, or to it otherwise
+    void transpose(const std::vector<float>& data, std::vector<float>& out, bool to_pixel_major)const;
+
     //! sizes of the respective axes.
     int   m_naxis1, m_naxis2, m_naxis3;
 
     //! for statistics of a fill
     double m_total, m_sumsq, m_count, m_min, m_max;
+    //! statistics of the last fill of each layer
+    std::vector<Statistics> m_stats;
 
     //! pointer to the associated tip Image class. The type is the base class, with 
     //! dynamic cast when necessary.
@@ -167,6 +321,10 @@ private:
     unsigned int m_pixelCount;
     bool m_save; 
     unsigned int m_layer;
+    unsigned int m_nthreads; ///< number of threads to use for fill
+    Layout m_layout; ///< order of m_imageData
+    mutable std::unique_ptr<Geometry> m_geometry; ///< made on demand, as it never changes
+    mutable std::mutex m_geometryMutex; ///< so that concurrent const calls make m_geometry once
 
     /// associated projection object, initialized from a par file, or a FITS header
     astro::SkyProj* m_wcs; 
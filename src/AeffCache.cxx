@@ -0,0 +1,183 @@
+/** @file AeffCache.cxx
+    @brief implement the class AeffCache
+
+    $Header$
+*/
+#include "map_tools/AeffCache.h"
+#include "map_tools/ContentHash.h"
+#include "healpix/CosineBinner.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace map_tools;
+using healpix::CosineBinner;
+
+namespace {
+    const char tag[8] = {'M','T','A','E','F','F','0','1'};
+
+    template<class T>
+    void put(std::ostream& out, const T& value)
+    {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+}
+
+AeffCache::AeffCache(const std::string& directory)
+: m_directory(directory)
+{
+    if( mkdir(directory.c_str(), 0755)!=0 && errno!=EEXIST ){
+        throw std::runtime_error("AeffCache: could not create directory "+directory);
+    }
+}
+
+std::string AeffCache::key(const std::string& irfs, const std::vector<std::string>& files,
+                           const std::vector<double>& energies, double ctcutoff, bool use_phi)
+{
+    const char* caldb(std::getenv("CALDB"));
+    ContentHash hash;
+    hash.add("irfs").add(irfs)
+        .add("caldb").add(std::string(caldb!=0? caldb : ""))
+        .add("files");
+    for( std::vector<std::string>::const_iterator it=files.begin(); it!=files.end(); ++it){
+        hash.addFileStat(*it);
+    }
+    hash.add("ctcutoff").add(ctcutoff)
+        .add("phi").add(use_phi? 1. : 0.)
+        .add("binning").add(CosineBinner::nbins()).add(CosineBinner::cosmin())
+        .add(CosineBinner::thetaBinning()).add(CosineBinner::nphibins())
+        .add("energies");
+    for( std::vector<double>::const_iterator it=energies.begin(); it!=energies.end(); ++it){
+        hash.add(*it);
+    }
+    return hash.str();
+}
+
+std::vector<std::string> AeffCache::irfFiles(const std::vector<std::string>& irfs)
+{
+    // the names without the event type, as they appear in the file names
+    std::vector<std::string> names;
+    for( std::vector<std::string>::const_iterator it=irfs.begin(); it!=irfs.end(); ++it){
+        names.push_back(it->substr(0, it->find("::")));
+    }
+    std::vector<std::string> dirs, files;
+    const char* caldb(std::getenv("CALDB"));
+    if( caldb!=0 ){
+        std::string root(caldb);
+        const char* subdirs[] = {"", "/data/glast/lat"};
+        for( int i=0; i<2; ++i){
+            std::string index(root+subdirs[i]+"/caldb.indx");
+            if( access(index.c_str(), R_OK)==0 ) files.push_back(index);
+            dirs.push_back(root+subdirs[i]+"/bcf/ea");
+        }
+    }
+    const char* custom(std::getenv("CUSTOM_IRF_DIR"));
+    if( custom!=0 ) dirs.push_back(custom);
+
+    for( std::vector<std::string>::const_iterator d=dirs.begin(); d!=dirs.end(); ++d){
+        DIR* dir = opendir(d->c_str());
+        if( dir==0 ) continue;
+        while( struct dirent* entry = readdir(dir) ){
+            std::string name(entry->d_name);
+            for( std::vector<std::string>::const_iterator n=names.begin(); n!=names.end(); ++n){
+                if( !n->empty() && name.find(*n)!=std::string::npos ){
+                    files.push_back(*d+"/"+name);
+                    break;
+                }
+            }
+        }
+        closedir(dir);
+    }
+    // readdir order is arbitrary
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+std::string AeffCache::path(const std::string& key)const
+{
+    return m_directory+"/aeff_"+key+".bin";
+}
+
+bool AeffCache::find(const std::string& key, Entry& entry)const
+{
+    std::string file(path(key));
+    int fd = open(file.c_str(), O_RDONLY);
+    if( fd<0 ) return false;
+    struct stat info;
+    if( fstat(fd, &info)!=0 || info.st_size==0 ){
+        close(fd);
+        return false;
+    }
+    size_t size(info.st_size);
+    void* map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( map==MAP_FAILED ) return false;
+
+    // a file that does not match its own sizes is ignored, and will be replaced
+    const char* data(static_cast<const char*>(map));
+    bool ok(false);
+    const size_t head(sizeof(tag)+3*sizeof(uint64_t));
+    if( size>=head && std::memcmp(data, tag, sizeof(tag))==0 ){
+        const uint64_t* counts(reinterpret_cast<const uint64_t*>(data+sizeof(tag)));
+        uint64_t layers(counts[0]), bins(counts[1]), phi(counts[2]);
+        if( size == head + layers*(sizeof(double)+sizeof(uint64_t)) + layers*bins*sizeof(double) ){
+            const double* etendue(reinterpret_cast<const double*>(data+head));
+            const uint64_t* sizes(reinterpret_cast<const uint64_t*>(etendue+layers));
+            const double* values(reinterpret_cast<const double*>(sizes+layers));
+            ok = true;
+            for( uint64_t k=0; k<layers; ++k) ok = ok && sizes[k]<=bins;
+            if( ok ){
+                entry.tables.clear();
+                for( uint64_t k=0; k<layers; ++k){
+                    const double* row(values+k*bins);
+                    entry.tables.push_back(BinnerTable(row, row+sizes[k]));
+                }
+                entry.etendue.assign(etendue, etendue+layers);
+                entry.use_phi = phi!=0;
+            }
+        }
+    }
+    munmap(map, size);
+    return ok;
+}
+
+void AeffCache::store(const std::string& key, const Entry& entry)const
+{
+    uint64_t layers(entry.tables.size()), bins(0);
+    for( uint64_t k=0; k<layers; ++k) bins = std::max<uint64_t>(bins, entry.tables[k].size());
+    if( entry.etendue.size()!=layers ) throw std::invalid_argument("AeffCache::store: need an etendue per table");
+
+    std::string file(path(key));
+    std::ostringstream temp;
+    temp << file << ".tmp" << getpid();
+    {
+        std::ofstream out(temp.str().c_str(), std::ios::binary);
+        out.write(tag, sizeof(tag));
+        put(out, layers);
+        put(out, bins);
+        put(out, static_cast<uint64_t>(entry.use_phi));
+        for( uint64_t k=0; k<layers; ++k) put(out, entry.etendue[k]);
+        for( uint64_t k=0; k<layers; ++k) put(out, static_cast<uint64_t>(entry.tables[k].size()));
+        for( uint64_t k=0; k<layers; ++k){
+            const BinnerTable& table(entry.tables[k]);
+            for( uint64_t j=0; j<bins; ++j) put(out, j<table.size()? table[j] : 0.);
+        }
+        if( !out ) throw std::runtime_error("AeffCache: could not write "+temp.str());
+    }
+    if( rename(temp.str().c_str(), file.c_str())!=0 ){
+        std::remove(temp.str().c_str());
+        throw std::runtime_error("AeffCache: could not replace "+file);
+    }
+}
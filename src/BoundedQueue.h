@@ -0,0 +1,69 @@
+/** @file BoundedQueue.h
+    @brief define BoundedQueue, used by Exposure::load to pass rows from a reader thread to the fill
+
+    $Header$
+*/
+#ifndef MAP_TOOLS_BOUNDEDQUEUE_H
+#define MAP_TOOLS_BOUNDEDQUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+namespace map_tools {
+
+/** @class BoundedQueue
+    @brief a first-in first-out queue between one producer and one consumer thread
+
+    push blocks while the queue holds depth items, so a fast producer is held back by a
+    slow consumer; pop blocks until an item arrives or the queue is closed.
+*/
+template <class T>
+class BoundedQueue {
+public:
+    BoundedQueue(size_t depth): m_depth(depth>0? depth : 1), m_closed(false){}
+
+    //! add an item, taken by swap, waiting for room. @return false if the queue was closed
+    bool push(T& item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_full.wait(lock, [this](){ return m_closed || m_items.size()<m_depth; });
+        if( m_closed ) return false;
+        m_items.push_back(T());
+        m_items.back().swap(item);
+        m_not_empty.notify_one();
+        return true;
+    }
+
+    //! take the next item, waiting for one. @return false if the queue is closed and empty
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_empty.wait(lock, [this](){ return m_closed || !m_items.empty(); });
+        if( m_items.empty() ) return false;
+        item.swap(m_items.front());
+        m_items.pop_front();
+        m_not_full.notify_one();
+        return true;
+    }
+
+    //! no more items: wakes both sides. Items already queued can still be popped
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_not_full.notify_all();
+        m_not_empty.notify_all();
+    }
+
+private:
+    size_t m_depth;
+    bool m_closed;
+    std::deque<T> m_items;
+    std::mutex m_mutex;
+    std::condition_variable m_not_full, m_not_empty;
+};
+
+} // namespace map_tools
+#endif
@@ -0,0 +1,224 @@
+/** @file CubeStore.cxx
+    @brief Implementation of class CubeStore
+
+   $Header$
+*/
+#include "map_tools/CubeStore.h"
+#include "map_tools/PointingColumns.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <cerrno>
+#include <cstdio>
+#include <sys/stat.h>
+
+using namespace map_tools;
+
+namespace {
+    const std::string index_name("index.txt");
+    const std::string table("Exposure"), table2("WEIGHTED_EXPOSURE");
+    //! first line of the index: the checkpoints of earlier stores had no sums
+    const std::string format_line("# CubeStore cumulative, with sums");
+
+    //! add the bins of an Exposure to the double sums, in the order of its pixels
+    void accumulate(const Exposure& e, std::vector<double>& sums)
+    {
+        size_t k(0);
+        for( SkyBinner::const_iterator it = e.data().begin(); it!=e.data().end(); ++it){
+            if( sums.size() < k+it->size() ) sums.resize(k+it->size(), 0.);
+            for( size_t j=0; j< it->size(); ++j) sums[k+j] += (*it)[j];
+            k += it->size();
+        }
+        if( k!=sums.size() ) throw std::runtime_error("CubeStore: checkpoints have different binning");
+    }
+    //! copy the double sums back to the bins
+    void assign(const std::vector<double>& sums, Exposure& e)
+    {
+        size_t k(0);
+        for( SkyBinner::iterator it = e.data().begin(); it!=e.data().end(); ++it){
+            if( sums.size() < k+it->size() ) throw std::runtime_error("CubeStore: checkpoints have different binning");
+            for( size_t j=0; j< it->size(); ++j) (*it)[j] = static_cast<float>(sums[k+j]);
+            k += it->size();
+        }
+    }
+    //! the name of the file of sums of a checkpoint file
+    std::string sums_name(const std::string& file)
+    {
+        return file.substr(0, file.rfind('.'))+".sums";
+    }
+}
+
+CubeStore::CubeStore(const std::string& directory)
+: m_directory(directory)
+{
+    if( mkdir(directory.c_str(), 0755)!=0 && errno!=EEXIST ){
+        throw std::runtime_error("CubeStore: could not create directory "+directory);
+    }
+    std::ifstream in((m_directory+"/"+index_name).c_str());
+    std::string line;
+    bool first(true);
+    while( std::getline(in, line) ){
+        if( first && line!=format_line ){
+            throw std::runtime_error("CubeStore: "+m_directory+" has checkpoints from an earlier version, without sums");
+        }
+        first=false;
+        if( line.empty() || line[0]=='#' ) continue;
+        std::istringstream fields(line);
+        double t; std::string file;
+        if( !(fields >> t >> file) ) throw std::runtime_error("CubeStore: bad index line: "+line);
+        if( !m_times.empty() && t<=m_times.back() ) throw std::runtime_error("CubeStore: index is not in time order");
+        m_times.push_back(t);
+        m_files.push_back(file);
+    }
+}
+
+void CubeStore::read(size_t k, std::unique_ptr<Exposure>& exposure, std::unique_ptr<Exposure>& weighted)const
+{
+    std::string file(m_directory+"/"+m_files[k]);
+    exposure.reset(new Exposure(file, table));
+    weighted.reset(new Exposure(file, table2));
+}
+
+void CubeStore::read(size_t k, Sums& sums)const
+{
+    std::string file(m_directory+"/"+sums_name(m_files[k]));
+    std::ifstream in(file.c_str(), std::ios::binary);
+    unsigned long long n(0);
+    in.read(reinterpret_cast<char*>(&n), sizeof(n));
+    sums.exposure.resize(n);
+    sums.weighted.resize(n);
+    if( n>0 ){
+        in.read(reinterpret_cast<char*>(&sums.exposure[0]), n*sizeof(double));
+        in.read(reinterpret_cast<char*>(&sums.weighted[0]), n*sizeof(double));
+    }
+    double totals[4];
+    in.read(reinterpret_cast<char*>(totals), sizeof(totals));
+    if( !in ) throw std::runtime_error("CubeStore: could not read "+file);
+    sums.total=totals[0]; sums.total2=totals[1]; sums.lost=totals[2]; sums.lost2=totals[3];
+}
+
+void CubeStore::difference(size_t first, size_t last, std::unique_ptr<Exposure>& exposure, std::unique_ptr<Exposure>& weighted)const
+{
+    read(0, exposure, weighted);
+    if( first>=last ) return;
+    Sums a, b;
+    read(first, a);
+    read(last, b);
+    if( a.exposure.size()!=b.exposure.size() ) throw std::runtime_error("CubeStore: checkpoints have different binning");
+    for( size_t k=0; k< b.exposure.size(); ++k){
+        b.exposure[k] -= a.exposure[k];
+        b.weighted[k] -= a.weighted[k];
+    }
+    assign(b.exposure, *exposure);
+    assign(b.weighted, *weighted);
+    exposure->addtotal(b.total-a.total);  weighted->addtotal(b.total2-a.total2);
+    exposure->addlost(b.lost-a.lost);     weighted->addlost(b.lost2-a.lost2);
+}
+
+void CubeStore::write(double t, const Exposure& exposure, const Exposure& weighted, const Sums& sums)
+{
+    std::ostringstream name;
+    name << "cube_" << std::setw(6) << std::setfill('0') << m_times.size() << ".fits";
+    std::string file(m_directory+"/"+name.str());
+    exposure.write(file, table);
+    weighted.write(file, table2, false);
+    exposure.writeCoverage(file);
+    {
+        std::string sumsfile(m_directory+"/"+sums_name(name.str()));
+        std::ofstream out(sumsfile.c_str(), std::ios::binary);
+        unsigned long long n(sums.exposure.size());
+        out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+        if( n>0 ){
+            out.write(reinterpret_cast<const char*>(&sums.exposure[0]), n*sizeof(double));
+            out.write(reinterpret_cast<const char*>(&sums.weighted[0]), n*sizeof(double));
+        }
+        double totals[] = {sums.total, sums.total2, sums.lost, sums.lost2};
+        out.write(reinterpret_cast<const char*>(totals), sizeof(totals));
+        if( !out ) throw std::runtime_error("CubeStore: could not write "+sumsfile);
+    }
+    m_times.push_back(t);
+    m_files.push_back(name.str());
+
+    // rewrite the whole index, so that an interrupted update leaves a consistent store
+    std::string index(m_directory+"/"+index_name), temp(index+".new");
+    {
+        std::ofstream out(temp.c_str());
+        out << format_line << std::endl << "# checkpoint time, file" << std::endl << std::setprecision(17);
+        for( size_t k=0; k<m_times.size(); ++k) out << m_times[k] << " " << m_files[k] << std::endl;
+        if( !out ) throw std::runtime_error("CubeStore: could not write "+temp);
+    }
+    if( rename(temp.c_str(), index.c_str())!=0 ) throw std::runtime_error("CubeStore: could not replace "+index);
+}
+
+void CubeStore::update(const tip::Table * scData, double cadence, double tstart,
+                       const Exposure::GTIvector& gti,
+                       double pixelsize, double cosbinsize, double zcut)
+{
+    if( !(cadence>0) ) throw std::invalid_argument("CubeStore::update: cadence must be positive");
+    if( m_times.empty() ){
+        Exposure exposure(pixelsize, cosbinsize, zcut), weighted(pixelsize, cosbinsize, zcut, true);
+        Sums sums;
+        accumulate(exposure, sums.exposure);
+        accumulate(weighted, sums.weighted);
+        write(tstart, exposure, weighted, sums);
+    }
+
+    double first, last;
+    if( !PointingColumns(scData).span(first, last) ) return;
+    GTIindex good(gti.empty()? Exposure::GTIvector(1, std::make_pair(m_times.front(), last)) : gti);
+    Sums sums;
+    read(m_times.size()-1, sums);
+    for( double t=m_times.back()+cadence; t<=last; t=m_times.back()+cadence){
+        // fill the new times into the empty first checkpoint, which has the binning of the store,
+        // then add the previous sums, in double
+        std::unique_ptr<Exposure> exposure, weighted;
+        read(0, exposure, weighted);
+        Exposure::GTIvector window(good.clip(m_times.back(), t));
+        if( !window.empty() ) exposure->load(scData, *weighted, window, false);
+        accumulate(*exposure, sums.exposure);
+        accumulate(*weighted, sums.weighted);
+        assign(sums.exposure, *exposure);
+        assign(sums.weighted, *weighted);
+        exposure->addtotal(sums.total);  weighted->addtotal(sums.total2);
+        exposure->addlost(sums.lost);    weighted->addlost(sums.lost2);
+        sums.total = exposure->total();  sums.total2 = weighted->total();
+        sums.lost = exposure->lost();    sums.lost2 = weighted->lost();
+        exposure->setCoverage(good.clip(m_times.front(), t));
+        write(t, *exposure, *weighted, sums);
+    }
+}
+
+void CubeStore::query(double t1, double t2, const tip::Table * scData,
+                      std::unique_ptr<Exposure>& exposure, std::unique_ptr<Exposure>& weighted)const
+{
+    if( !(t1<t2) ) throw std::invalid_argument("CubeStore::query: need t1 < t2");
+    if( m_times.empty() ) throw std::runtime_error("CubeStore::query: the store is empty");
+
+    // the checkpoints a, at or after t1, and b, at or before t2
+    size_t a( std::lower_bound(m_times.begin(), m_times.end(), t1) - m_times.begin() ),
+           b( std::upper_bound(m_times.begin(), m_times.end(), t2) - m_times.begin() );
+    bool inside( a<m_times.size() && b>0 && a<=b-1 );
+
+    // checkpoint b-1 less checkpoint a, or an empty cube with the binning of the store
+    if( inside ) difference(a, b-1, exposure, weighted);
+    else difference(0, 0, exposure, weighted);
+
+    Exposure::GTIvector edges;
+    if( inside ){
+        if( t1 < m_times[a] ) edges.push_back(std::make_pair(t1, m_times[a]));
+        if( m_times[b-1] < t2 ) edges.push_back(std::make_pair(m_times[b-1], t2));
+    }else{
+        edges.push_back(std::make_pair(t1, t2));
+    }
+    Exposure::GTIvector covered;
+    if( inside && a<b-1 ) covered.push_back(std::make_pair(m_times[a], m_times[b-1]));
+    exposure->setCoverage(covered);
+    weighted->setCoverage(covered);
+    if( edges.empty() ) return;
+
+    if( scData==0 ) throw std::invalid_argument("CubeStore::query: need the spacecraft table for times between checkpoints");
+    exposure->load(scData, *weighted, edges, false);
+}
@@ -29,21 +29,26 @@ int DiffuseFunction::layer(double e)const
     return static_cast<int>(step);
 }
 
-void DiffuseFunction::setEnergy(double e)
+void DiffuseFunction::interpolation(double e, int& layer, double& fract)const
 {
     static double log2(log(2.0));
-    m_energy = e;
     double step ( log(e/s_emin)/log2 );
-    m_layer = static_cast<int>(step);
-    if( m_layer >= layers()-1 ){
-        m_layer = layers()-1; // set for maximum
-        m_fract=0;
+    layer = static_cast<int>(step);
+    if( layer >= layers()-1 ){
+        layer = layers()-1; // set for maximum
+        fract=0;
     }else {
-        m_fract = step - m_layer;
-        m_fract = sqrt(m_fract); // interpolate according to e**-2?.
+        fract = step - layer;
+        fract = sqrt(fract); // interpolate according to e**-2?.
     }
 }
 
+void DiffuseFunction::setEnergy(double e)
+{
+    m_energy = e;
+    interpolation(e, m_layer, m_fract);
+}
+
 double DiffuseFunction::h(double r, double alpha)
 {
     return (1.-pow(r,-alpha))/alpha;
@@ -51,27 +56,44 @@ double DiffuseFunction::h(double r, double alpha)
 
 double DiffuseFunction::operator()(const astro::SkyDir& dir) const
 {
-    double a ( m_data.pixelValue(dir, m_layer) );
-    if( m_fract==0) return a;
-    double b(m_data.pixelValue(dir, m_layer+1) );
-    return b*m_fract + a*(1-m_fract) 
-        + extraGal(m_energy);
+    return interpolate(m_data->pixelIndex(dir), m_layer, m_fract, m_energy);
 }
 double DiffuseFunction::operator ()(double energy){
     this->setEnergy(energy);
     return operator()(m_dir);
 }
 
-double DiffuseFunction::integral(const astro::SkyDir& dir, double a, double b)const
+double DiffuseFunction::value(const astro::SkyDir& dir, double energy)const
+{
+    return value(m_data->pixelIndex(dir), energy);
+}
+
+double DiffuseFunction::value(unsigned int pixel, double energy)const
+{
+    int k; 
+    double fract;
+    interpolation(energy, k, fract);
+    return interpolate(pixel, k, fract, energy);
+}
+
+double DiffuseFunction::interpolate(unsigned int pixel, int k, double fract, double energy)const
+{
+    double a ( m_data->layerValue(pixel, k) );
+    if( fract==0) return a;
+    double b(m_data->layerValue(pixel, k+1) );
+    return b*fract + a*(1-fract) 
+        + extraGal(energy);
+}
+
+double DiffuseFunction::power_law_integral(int k, double vk, double vkp, double a, double b)
 {
     static double log2(log(2.));
     ///@todo: generalize this for intervals larger than a factor of 3 
-    int k(layer(a));   // nearest index
     double Ek( energy_bin(k) ); // energy for nearest value
 
     // flux*energy values for this and the next bin
-    double Fk( Ek*m_data.pixelValue(dir,k) ) 
-        ,  Fkp( 2.*Ek*m_data.pixelValue(dir,k+1) );
+    double Fk( Ek*vk ) 
+        ,  Fkp( 2.*Ek*vkp );
 
     // the power law index, and final integral
     double alpha( log(Fk/Fkp)/log2 )
@@ -79,18 +101,35 @@ double DiffuseFunction::integral(const astro::SkyDir& dir, double a, double b)co
     return Q;
 }
 
+double DiffuseFunction::integral(const astro::SkyDir& dir, double a, double b)const
+{
+    return integral(m_data->pixelIndex(dir), a, b);
+}
+
+double DiffuseFunction::integral(unsigned int pixel, double a, double b)const
+{
+    int k(layer(a));   // nearest index
+    return power_law_integral(k, m_data->layerValue(pixel,k), m_data->layerValue(pixel,k+1), a, b);
+}
+
 
 std::vector<double> DiffuseFunction::integral(const astro::SkyDir& dir, const std::vector<double>&energies)const
 {
     std::vector<double> result;
     static double infinity (300000);
+    if( energies.empty() ) return result;
+
+    // one projection, then the whole spectrum of the pixel
+    std::vector<double> spectrum(m_data->layers());
+    m_data->layerValues(m_data->pixelIndex(dir), 0, spectrum.size(), &spectrum[0]);
 
     for( std::vector<double>::const_iterator it = energies.begin(); it!=energies.end(); ++it){
         std::vector<double>::const_iterator next(it+1);
         double a = *it;
         double b = next!=energies.end()? *next : infinity;
-        result.push_back(integral(dir,a,b));
+        int k(layer(a));
+        // at() rejects layers outside the cube, as layerValue does
+        result.push_back(power_law_integral(k, spectrum.at(k), spectrum.at(k+1), a, b));
     }
     return result;
 }
-
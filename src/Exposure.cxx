@@ -4,13 +4,24 @@
    $Header: /nfs/slac/g/glast/ground/cvs/ScienceTools-scons/map_tools/src/Exposure.cxx,v 1.37 2009/05/20 00:40:14 burnett Exp $
 */
 #include "map_tools/Exposure.h"
+#include "map_tools/PointingGrid.h"
+#include "map_tools/PointingColumns.h"
+#include "FillKernels.h"
+#include "BoundedQueue.h"
+#include "WorkerPool.h"
 #include "healpix/HealpixArrayIO.h"
 #include "tip/Table.h"
+#include "tip/IFileSvc.h"
+#include "tip/TipException.h"
 #include "astro/EarthCoordinate.h"
 #include "astro/PointingTransform.h"
 
 #include <memory>
 #include <algorithm>
+#include <cmath>
+#include <thread>
+#include <exception>
+#include <stdexcept>
 
 using namespace map_tools;
 using healpix::HealpixArrayIO;
@@ -20,8 +31,22 @@ using healpix::Healpix;
 
 Exposure::Exposure(const std::string& inputfile, const std::string& tablename)
 : SkyExposure(SkyBinner(2))
+, m_zcut(-1), m_zmaxcut(1), m_lost(0)
+, m_weighted(false)
+, m_nthreads(1)
+, m_batchsize(1)
+, m_tilesize(0)
+, m_companion(0)
+, m_pool(0)
+, m_prune(true)
+, m_aggregation(0)
+, m_aggregated_rows(0), m_aggregated_cells(0)
+, m_queuedepth(0)
+, m_recorded(false)
 {
    setData( HealpixArrayIO::instance().read(inputfile, tablename));
+   create_cache();
+   readCoverage(inputfile, tablename);
 }
 
 /// return the closest power of 2 for the side parameter
@@ -35,50 +60,95 @@ inline int side_from_degrees(double pixelsize){
     return n; 
 } 
 
-Exposure::Exposure(double pixelsize, double cosbinsize, double zcut, bool weighted, double zmaxcut)
-: SkyExposure(
-    SkyBinner(Healpix(
+/// set the cos(theta) binning, then return the pixelization: the CosineBinner objects made
+/// for the pixels then have the right number of bins, including any phi bins, from the start
+inline Healpix binned_healpix(double pixelsize, double cosbinsize){
+    unsigned int cosbins = static_cast<unsigned int>(1./cosbinsize);
+    if( cosbins != CosineBinner::nbins() ) {
+        CosineBinner::setBinning(0, cosbins);
+    }
+    return Healpix(
       side_from_degrees(pixelsize),  // nside
       Healpix::NESTED, 
-      astro::SkyDir::EQUATORIAL) )
-  )
+      astro::SkyDir::EQUATORIAL);
+}
+
+Exposure::Exposure(double pixelsize, double cosbinsize, double zcut, bool weighted, double zmaxcut)
+: SkyExposure( SkyBinner(binned_healpix(pixelsize, cosbinsize)) )
 , m_zcut(zcut), m_zmaxcut(zmaxcut), m_lost(0)
 , m_weighted(weighted)
+, m_nthreads(1)
+, m_batchsize(1)
+, m_tilesize(0)
+, m_companion(0)
+, m_pool(0)
+, m_prune(true)
+, m_aggregation(0)
+, m_aggregated_rows(0), m_aggregated_cells(0)
+, m_queuedepth(0)
+, m_recorded(true)
 {
-    unsigned int cosbins = static_cast<unsigned int>(1./cosbinsize);
-    if( cosbins != CosineBinner::nbins() ) {
-        // bins per pixel: depends on phi or not
-        unsigned int allbins(cosbins);
-        if( CosineBinner::nphibins() > 0 ){
-            // add size for extra phi bins.
-            allbins += cosbins * healpix::CosineBinner::nphibins();
-        }
-        
-        SkyBinner::iterator is = data().begin();
-        for( ; is != data().end(); ++is){ // loop over all pixels
-            CosineBinner & pixeldata= *is; // get the contents of this pixel
-            pixeldata.resize(allbins);
-            CLHEP::Hep3Vector pixdir = data().dir(is)();
-        }
-        CosineBinner::setBinning(0, cosbins);
-    }
     create_cache();
 }
 
 void Exposure::create_cache()
 {
     size_t datasize(data().size());
-    m_dir_cache.reserve(datasize);
+    m_dir_cache.x.reserve(datasize);
+    m_dir_cache.y.reserve(datasize);
+    m_dir_cache.z.reserve(datasize);
+    m_dir_cache.bins.reserve(datasize);
+    m_dir_cache.binner.reserve(datasize);
 
     SkyBinner::iterator is = data().begin();
     for( ; is != data().end(); ++is){ // loop over all pixels
         Simple3Vector pixdir(data().dir(is)());
-        m_dir_cache.push_back(std::make_pair(&*is, pixdir));
+        m_dir_cache.x.push_back(pixdir.x);
+        m_dir_cache.y.push_back(pixdir.y);
+        m_dir_cache.z.push_back(pixdir.z);
+        m_dir_cache.bins.push_back(&*is->begin());
+        m_dir_cache.binner.push_back(&*is);
+    }
+
+    // in the nested scheme, blocks of 4**k consecutive pixels are the pixels of a coarser
+    // map: use two such levels to prune the fill
+    if( data().healpix().nested() ){
+        static const size_t blocks[] = {4096, 64};
+        for( size_t i=0; i< sizeof(blocks)/sizeof(size_t); ++i){
+            if( datasize >= 12*blocks[i] ) add_level(blocks[i]);
+        }
+    }
+}
+
+void Exposure::add_level(size_t blocksize)
+{
+    m_dir_cache.levels.push_back(DirCache::Level());
+    DirCache::Level& level(m_dir_cache.levels.back());
+    level.size = blocksize;
+    const DirCache& c(m_dir_cache);
+    for( size_t first=0; first < c.size(); first+=blocksize){
+        size_t last(std::min(first+blocksize, c.size()));
+        double sx(0), sy(0), sz(0);
+        for( size_t k=first; k<last; ++k){ sx+=c.x[k]; sy+=c.y[k]; sz+=c.z[k]; }
+        double norm(sqrt(sx*sx+sy*sy+sz*sz));
+        sx/=norm; sy/=norm; sz/=norm;
+        // the radius is set by the pixel farthest from the center
+        double cosr(1);
+        for( size_t k=first; k<last; ++k){
+            cosr = std::min(cosr, sx*c.x[k]+sy*c.y[k]+sz*c.z[k]);
+        }
+        level.cx.push_back(sx); level.cy.push_back(sy); level.cz.push_back(sz);
+        level.cosr.push_back(cosr);
+        level.sinr.push_back(sqrt(std::max(0., 1.-cosr*cosr)));
     }
 }
 
 /** @class Filler
-    @brief private helper class used in for_each to fill a CosineBinner object
+    @brief private helper class used to fill the CosineBinner objects for a range of pixels
+
+    The vectorized kernel classifies a chunk of pixels by zenith cut and cos(theta) bin, and
+    by phi bin if they are enabled; the bin contents are then incremented by a scatter-add
+    over the results.
 */
 class Exposure::Filler {
 public:
@@ -91,70 +161,249 @@ public:
         @param zcut optional cut: if -1, ignore
     */
    Filler( double deltat, const astro::SkyDir& dirz, const astro::SkyDir& dirx, astro::SkyDir zenith=astro::SkyDir(), double zcut=-1, double zmaxcut=1)
-        : m_dirz(dirz())
-        , m_rot(astro::PointingTransform(dirz,dirx).localToCelestial().inverse())
-        , m_zenith(zenith())
+        : m_rot(astro::PointingTransform(dirz,dirx).localToCelestial().inverse())
         , m_deltat(deltat)
-        , m_zcut(zcut)
-        , m_zmaxcut(zmaxcut)
-        , m_total(0), m_lost(0)
+        , m_second(0), m_deltat2(0)
+        , m_total(0), m_lost(0), m_total2(0), m_lost2(0)
         , m_use_phi(CosineBinner::nphibins()>0)
-    {}
+        , m_prune(false)
+    {
+        setup(dirz, zenith, zcut, zmaxcut);
+        m_pointing.rotx[0]=m_rot.xx(); m_pointing.rotx[1]=m_rot.xy(); m_pointing.rotx[2]=m_rot.xz();
+        m_pointing.roty[0]=m_rot.yx(); m_pointing.roty[1]=m_rot.yy(); m_pointing.roty[2]=m_rot.yz();
+        m_pointing.rotz[0]=m_rot.zx(); m_pointing.rotz[1]=m_rot.zy(); m_pointing.rotz[2]=m_rot.zz();
+    }
    Filler( double deltat, const astro::SkyDir& dirz, astro::SkyDir zenith=astro::SkyDir(), double zcut=-1, double zmaxcut=1)
-        : m_dirz(dirz())
-        , m_zenith(zenith())
-        , m_deltat(deltat)
-        , m_zcut(zcut)
-        , m_zmaxcut(zmaxcut)
-        , m_total(0), m_lost(0)
+        : m_deltat(deltat)
+        , m_second(0), m_deltat2(0)
+        , m_total(0), m_lost(0), m_total2(0), m_lost2(0)
         , m_use_phi(false)
-    {}
-    void operator()( const std::pair<CosineBinner*, Simple3Vector> & x)
+        , m_prune(false)
     {
-        // check if we are making a horizon cut:
-        bool ok( m_zcut==-1 && m_zmaxcut==1);
-        if( ! ok) {
-            double z(x.second.dot(m_zenith));
-            ok = z > m_zcut && z < m_zmaxcut;
-        }
-        if( ok) {
-            // if ok, add to the angle histogram
-            const Simple3Vector& pixeldir(x.second);
-            if( m_use_phi) {
-                CLHEP::Hep3Vector instrument_dir( pixeldir.transform(m_rot) );
-                 double costheta(instrument_dir.z()), phi(instrument_dir.phi());
-                x.first->fill( costheta, phi , m_deltat);
-            }else{
-                x.first->fill( pixeldir.dot(m_dirz), m_deltat);
-            }
+        setup(dirz, zenith, zcut, zmaxcut);
+    }
 
-            m_total += m_deltat;
+    /** @brief also fill a second set of bins with the same pixel geometry
+        @param cache cache of a second Exposure, with the same pixels
+        @param deltat2 time to add to it
+    */
+    void setSecond(const DirCache* cache, double deltat2){ m_second=cache; m_deltat2=deltat2;}
+    bool second()const{return m_second!=0;}
+
+    //! set to use the pixel hierarchy of the cache, if any, to skip blocks
+    void setPruning(bool prune){m_prune=prune;}
+
+    /// fill the pixels [first, last) of the cache
+    void operator()( const DirCache& cache, size_t first, size_t last)
+    {
+        if( m_prune && !cache.levels.empty() ){
+            visit(cache, 0, first, last);
         }else{
-            m_lost += m_deltat;
+            fill(cache, first, last);
+        }
+    }
+
+    /// fill the pixels [first, last) of the cache, all of them
+    void fill( const DirCache& cache, size_t first, size_t last)
+    {
+        static const size_t chunk(512);
+        int bins[chunk], phibins[chunk];
+        const int nbins(m_cosbins.count());
+        for( size_t k=first; k<last; k+=chunk){
+            size_t n(std::min(chunk, last-k));
+            kernels::classify(&cache.x[k], &cache.y[k], &cache.z[k], n, m_pointing, m_cosbins, bins);
+            if( m_use_phi ){
+                kernels::classify_phi(&cache.x[k], &cache.y[k], &cache.z[k], n, 
+                    m_pointing, m_cosbins, m_phibins, bins, phibins);
+            }
+            for( size_t i=0; i<n; ++i){
+                int bin(bins[i]);
+                if( bin<0 ){
+                    m_lost += m_deltat; // failed zenith cut
+                    m_lost2 += m_deltat2;
+                    continue;
+                }
+                if( m_use_phi) {
+                    if( bin < nbins ){
+                        // as CosineBinner::fill: the cos(theta) bin, and the same bin in the phi block
+                        int phibin( bin + nbins*(1+phibins[i]) );
+                        cache.bins[k+i][bin] += m_deltat;
+                        cache.bins[k+i][phibin] += m_deltat;
+                        if( m_second ){
+                            m_second->bins[k+i][bin] += m_deltat2;
+                            m_second->bins[k+i][phibin] += m_deltat2;
+                        }
+                    }
+                }else if( bin < nbins ){
+                    cache.bins[k+i][bin] += m_deltat;
+                    if( m_second ) m_second->bins[k+i][bin] += m_deltat2;
+                }
+                m_total += m_deltat;
+                m_total2 += m_deltat2;
+            }
         }
     }
     double total()const{return m_total;}
     double lost()const{return m_lost;}
+    double total2()const{return m_total2;} ///< total for the second set of bins
+    double lost2()const{return m_lost2;}
+    //! accumulate the totals from a Filler that was applied to another set of pixels
+    void add(const Filler& other){ 
+        m_total+=other.m_total; m_lost+=other.m_lost;
+        m_total2+=other.m_total2; m_lost2+=other.m_lost2;
+    }
 private:
-    Simple3Vector m_dirz;
+    /** @brief the range of cos(angle) between an axis and the pixels of a block
+        @param level the level in the hierarchy
+        @param b the block index
+        @param axis unit vector
+        @param lo, hi set to bounds on the cosines, widened to allow for round-off
+    */
+    static void bounds(const DirCache::Level& level, size_t b, const double* axis, double& lo, double& hi)
+    {
+        static const double eps(1e-9);
+        double cosa( level.cx[b]*axis[0] + level.cy[b]*axis[1] + level.cz[b]*axis[2] ),
+            sina( sqrt(std::max(0., 1.-cosa*cosa)) ),
+            cosr( level.cosr[b] ), sinr( level.sinr[b] );
+        // cos(a+r) and cos(a-r), limited to the range 0 to pi
+        lo = cosa < -cosr ? -1 : cosa*cosr - sina*sinr;
+        hi = cosa >  cosr ?  1 : cosa*cosr + sina*sinr;
+        lo -= eps; hi += eps;
+    }
+
+    /// fill the pixels [first, last), skipping blocks at this level of the hierarchy when possible
+    void visit( const DirCache& cache, size_t ilevel, size_t first, size_t last)
+    {
+        const DirCache::Level& level(cache.levels[ilevel]);
+        const double cosmin(1.-m_cosbins.range());
+        for( size_t b=first/level.size; b*level.size < last; ++b){
+            size_t lo(std::max(first, b*level.size)), hi(std::min(last, (b+1)*level.size));
+            double n(static_cast<double>(hi-lo));
+
+            // zenith cut: all pass, all fail, or some of each
+            bool zen_all(true);
+            if( m_pointing.zcut ){
+                double zlo, zhi;
+                bounds(level, b, m_pointing.zenith, zlo, zhi);
+                if( zhi <= m_pointing.zmin || zlo >= m_pointing.zmax ){
+                    m_lost += n*m_deltat;
+                    m_lost2 += n*m_deltat2;
+                    continue;
+                }
+                zen_all = zlo > m_pointing.zmin && zhi < m_pointing.zmax;
+            }
+            // field of view: skip if all below cosmin, and all pass the zenith cut
+            double clo, chi;
+            bounds(level, b, m_pointing.dirz, clo, chi);
+            if( chi < cosmin && zen_all ){
+                m_total += n*m_deltat;
+                m_total2 += n*m_deltat2;
+                continue;
+            }
+            if( ilevel+1 < cache.levels.size() && !(zen_all && clo >= cosmin) ){
+                visit(cache, ilevel+1, lo, hi); // refine a block that straddles a boundary
+            }else{
+                fill(cache, lo, hi);
+            }
+        }
+    }
+
+    void setup(const astro::SkyDir& dirz, const astro::SkyDir& zenith, double zcut, double zmaxcut)
+    {
+        Simple3Vector z(dirz()), zen(zenith());
+        m_pointing.dirz[0]=z.x;     m_pointing.dirz[1]=z.y;     m_pointing.dirz[2]=z.z;
+        m_pointing.zenith[0]=zen.x; m_pointing.zenith[1]=zen.y; m_pointing.zenith[2]=zen.z;
+        // check if we are making a horizon cut:
+        m_pointing.zcut = !(zcut==-1 && zmaxcut==1);
+        m_pointing.zmin = zcut;
+        m_pointing.zmax = zmaxcut;
+    }
     CLHEP::HepRotation m_rot;
-    Simple3Vector m_zenith;
-   double m_deltat, m_zcut, m_zmaxcut;
-    mutable double m_total, m_lost;
+    kernels::Pointing m_pointing;
+    kernels::CosineBins m_cosbins;
+    kernels::PhiBins m_phibins;
+    double m_deltat;
+    const DirCache* m_second;
+    double m_deltat2;
+    mutable double m_total, m_lost, m_total2, m_lost2;
     bool m_use_phi;
+    bool m_prune;
 };
 
 
+size_t Exposure::tile_size(bool second)const
+{
+    if( m_tilesize>0 ) return m_tilesize;
+    // bytes per pixel: the direction, the pointers and the bins themselves
+    static const size_t cache_bytes(256*1024);
+    size_t allbins(m_dir_cache.size()>0? m_dir_cache.binner[0]->size() : CosineBinner::nbins());
+    size_t bytes( 3*sizeof(double) + sizeof(float*) + sizeof(CosineBinner*) + allbins*sizeof(float) );
+    if( second ) bytes += sizeof(float*) + sizeof(CosineBinner*) + allbins*sizeof(float);
+    return std::max<size_t>(64, cache_bytes/bytes/64*64); // whole blocks of the pixel hierarchy
+}
+
+void Exposure::fill_tiles(std::vector<Filler>& fillers, size_t first, size_t last)const
+{
+    size_t tile(tile_size(!fillers.empty() && fillers.front().second()));
+    for( size_t t=first; t<last; t+=tile){
+        size_t end(std::min(t+tile, last));
+        for( std::vector<Filler>::iterator it=fillers.begin(); it!=fillers.end(); ++it){
+            (*it)(m_dir_cache, t, end);
+        }
+    }
+}
+
+void Exposure::apply(std::vector<Filler>& fillers)
+{
+    for( std::vector<Filler>::iterator it=fillers.begin(); it!=fillers.end(); ++it){
+        it->setPruning(m_prune);
+    }
+    size_t npix(m_dir_cache.size());
+    size_t nthreads(m_pool!=0? m_pool->size() : std::min<size_t>(m_nthreads, npix));
+    if( nthreads<=1 ){
+        fill_tiles(fillers, 0, npix);
+        return;
+    }
+    // each worker owns a contiguous range of pixels, so no locks are needed on the CosineBinner objects;
+    // the boundaries are kept on multiples of 8 pixels to keep the vector loads aligned
+    std::vector<std::vector<Filler> > local(nthreads, fillers);
+    std::function<void(size_t)> work = [this, npix, nthreads, &local](size_t i){
+        size_t first( i==0?          0    : npix*i/nthreads/8*8   ),
+               last ( i==nthreads-1? npix : npix*(i+1)/nthreads/8*8 );
+        fill_tiles(local[i], first, last);
+    };
+    if( m_pool!=0 ){
+        m_pool->run(work);
+    }else{
+        std::vector<std::thread> workers;
+        workers.reserve(nthreads);
+        for( size_t i=0; i< nthreads; ++i) workers.push_back(std::thread(work, i));
+        for( size_t i=0; i< nthreads; ++i) workers[i].join();
+    }
+
+    // reduce in thread order so that the sums do not depend on scheduling
+    for( size_t i=0; i< nthreads; ++i){
+        for( size_t j=0; j< fillers.size(); ++j) fillers[j].add(local[i][j]);
+    }
+}
+
+Exposure::Filler Exposure::apply(const Filler& filler)
+{
+    std::vector<Filler> fillers(1, filler);
+    apply(fillers);
+    return fillers.front();
+}
+
 void Exposure::fill(const astro::SkyDir& dirz, double deltat)
 {
-    Filler sum = for_each(m_dir_cache.begin(), m_dir_cache.end(), Filler(deltat, dirz));
+    apply(Filler(deltat, dirz));
     addtotal(deltat);
 }
 
 
 void Exposure::fill(const astro::SkyDir& dirz, const astro::SkyDir& zenith, double deltat)
 {
-   Filler sum = for_each(m_dir_cache.begin(), m_dir_cache.end(), Filler(deltat, dirz, zenith, m_zcut, m_zmaxcut));
+    Filler sum = apply(Filler(deltat, dirz, zenith, m_zcut, m_zmaxcut));
     double total(sum.total());
     addtotal(total);
     m_lost += sum.lost();
@@ -164,96 +413,288 @@ void Exposure::fill_zenith(const astro::SkyDir& dirz,const astro::SkyDir& dirx,
                            const astro::SkyDir& zenith, 
                            double deltat)
 {
-    Filler sum = for_each(m_dir_cache.begin(), m_dir_cache.end(), 
-                          Filler(deltat, dirz, dirx, zenith, m_zcut, m_zmaxcut));
+    Filler sum = apply(Filler(deltat, dirz, dirx, zenith, m_zcut, m_zmaxcut));
     double total(sum.total());
     addtotal(total);
     m_lost += sum.lost();
 }
 
 
-void Exposure::write(const std::string& outputfile, const std::string& tablename)const
+void Exposure::fill_batch(const std::vector<PointingRow>& rows, Exposure* weighted)
 {
-    healpix::HealpixArrayIO::instance().write(data(), outputfile, tablename);
+    if( weighted!=0 && weighted->m_dir_cache.size()!=m_dir_cache.size() ){
+        throw std::invalid_argument("Exposure::fill_batch: weighted exposure has different binning");
+    }
+    std::vector<Filler> fillers;
+    fillers.reserve(rows.size());
+    for( std::vector<PointingRow>::const_iterator it=rows.begin(); it!=rows.end(); ++it){
+        fillers.push_back(Filler(it->deltat, it->dirz, it->dirx, it->zenith, m_zcut, m_zmaxcut));
+        if( weighted!=0 ) fillers.back().setSecond(&weighted->m_dir_cache, it->wdeltat);
+    }
+    apply(fillers);
+    for( std::vector<Filler>::const_iterator it=fillers.begin(); it!=fillers.end(); ++it){
+        addtotal(it->total());
+        m_lost += it->lost();
+        if( weighted!=0 ){
+            weighted->addtotal(it->total2());
+            weighted->m_lost += it->lost2();
+        }
+    }
+}
+
+void Exposure::fill_rows(const std::vector<PointingRow>& rows)
+{
+    if( m_batchsize<=1 && m_companion==0 ){
+        for( std::vector<PointingRow>::const_iterator it=rows.begin(); it!=rows.end(); ++it){
+            fill_zenith(it->dirz, it->dirx, it->zenith, it->deltat);
+        }
+    }else{
+        fill_batch(rows, m_companion);
+    }
+}
+
+void Exposure::write(const std::string& outputfile, const std::string& tablename, bool clobber)const
+{
+    healpix::HealpixArrayIO::instance().write(data(), outputfile, tablename, clobber);
+
+    // the cuts and the time range, so that rows can be added later
+    std::unique_ptr<tip::Table> table(tip::IFileSvc::instance().editTable(outputfile, tablename));
+    tip::Header& header(table->getHeader());
+    header["ZMIN"].set(m_zcut);
+    header["ZMAX"].set(m_zmaxcut);
+    if( !m_coverage.empty() ){
+        header["TSTART"].set(m_coverage.intervals().front().first);
+        header["TSTOP"].set(m_coverage.intervals().back().second);
+    }
+}
+
+void Exposure::subtract(const Exposure& other)
+{
+    if( other.data().size()!=data().size() ){
+        throw std::invalid_argument("Exposure::subtract: different binning");
+    }
+    SkyBinner::const_iterator o = other.data().begin();
+    for( SkyBinner::iterator is = data().begin(); is!=data().end(); ++is, ++o){
+        if( o->size()!=is->size() ) throw std::invalid_argument("Exposure::subtract: different binning");
+        for( size_t j=0; j< is->size(); ++j) (*is)[j] -= (*o)[j];
+    }
+    addtotal(-other.total());
+    m_lost -= other.m_lost;
+}
+
+void Exposure::writeCoverage(const std::string& outputfile, const std::string& tablename)const
+{
+    tip::IFileSvc::instance().appendTable(outputfile, tablename);
+    std::unique_ptr<tip::Table> table(tip::IFileSvc::instance().editTable(outputfile, tablename));
+    table->appendField("START", "1D");
+    table->appendField("STOP", "1D");
+    // distinguishes it from a GTI extension with another meaning
+    table->getHeader()["EXPCOVER"].set(true);
+    const GTIvector& gti(m_coverage.intervals());
+    table->setNumRecords(gti.size());
+    tip::Table::Iterator row(table->begin());
+    for( GTIvector::const_iterator it=gti.begin(); it!=gti.end(); ++it, ++row){
+        (*row)["START"].set(it->first);
+        (*row)["STOP"].set(it->second);
+    }
+}
+
+void Exposure::readCoverage(const std::string& inputfile, const std::string& tablename)
+{
+    std::unique_ptr<const tip::Table> table(tip::IFileSvc::instance().readTable(inputfile, tablename));
+    const tip::Header& header(table->getHeader());
+    // files written before the cuts were recorded have no keywords and no coverage
+    try{
+        header["ZMIN"].get(m_zcut);
+        header["ZMAX"].get(m_zmaxcut);
+    }catch(const tip::TipException&){
+        return;
+    }
+    m_recorded = true;
+    try{
+        std::unique_ptr<const tip::Table> gti(tip::IFileSvc::instance().readTable(inputfile, "GTI"));
+        // only the times written by writeCoverage, not the GTIs of a file from another tool
+        bool marked(false);
+        gti->getHeader()["EXPCOVER"].get(marked);
+        if( !marked ) return;
+        GTIvector intervals;
+        for( tip::Table::ConstIterator it=gti->begin(); it!=gti->end(); ++it){
+            double start, stop;
+            (*it)["START"].get(start);
+            (*it)["STOP"].get(stop);
+            intervals.push_back(std::make_pair(start, stop));
+        }
+        m_coverage.add(intervals);
+    }catch(const tip::TipException&){
+    }
+}
+
+void Exposure::checkAppend(double cosbinsize, double zcut)const
+{
+    if( data()[0].size() != CosineBinner::nbins()*(1+CosineBinner::nphibins()) 
+        || static_cast<unsigned int>(1./cosbinsize) != CosineBinner::nbins() ){
+        throw std::invalid_argument("Exposure: binning differs from the cube to append to");
+    }
+    // no record is not the same as no times: the rows would all be added again
+    if( !m_recorded ){
+        throw std::invalid_argument("Exposure: the cube to append to has no zenith cut keywords");
+    }
+    if( zcut != m_zcut ){
+        throw std::invalid_argument("Exposure: zmin differs from the cube to append to");
+    }
+    if( coverage().empty() ){
+        throw std::invalid_argument("Exposure: the cube to append to has no record of the times it includes");
+    }
+}
+
+void Exposure::read(const tip::Table * scData, GTIindex& gti, bool verbose,
+                    const std::function<bool(std::vector<PointingRow>&)>& deliver)
+{
+   static const size_t columnblock(4096); // rows copied from each column into a block at a time
+   PointingColumns columns(scData);
+   long nrows = columns.rows();
+   long tick(std::max(1L, nrows/20)), next(0);
+   size_t block(std::max<size_t>(m_batchsize, 1));
+   std::vector<PointingRow> rows;
+
+   // skip the rows before the first good-time interval
+   long begin( gti.empty()? 0 : columns.find(gti.intervals().front().first) );
+   next = begin;
+   for (long first = begin; first < nrows; first += columnblock) {
+      size_t n(columns.read(first, columnblock));
+      for( size_t i=0; i<n; ++i){
+          if (verbose && first+long(i) >= next ){ std::cerr << "."; next += tick; }
+          if( processEntry( columns, i, gti, rows) ){
+              if( !rows.empty() ) deliver(rows);
+              return;
+          }
+          if( rows.size()>=block ){
+              if( !deliver(rows) ) return;
+              rows.clear();
+          }
+      }
+   }
+   if( !rows.empty() ) deliver(rows);
 }
 
 void Exposure::load(const tip::Table * scData, 
                     const GTIvector& gti, 
                     bool verbose) {
    
-   tip::Table::ConstIterator it = scData->begin();
-   const tip::ConstTableRecord & row = *it;
-   long nrows = scData->getNumRecords();
+   // the times this table can add: the GTIs, or all of it, clipped to the rows of the table
+   double tstart, tstop;
+   if( !PointingColumns(scData).span(tstart, tstop) ) return;
+   GTIindex wanted( gti.empty()? GTIvector(1, std::make_pair(tstart, tstop)) : gti );
+   GTIvector todo( m_coverage.subtract(wanted.clip(tstart, tstop)) );
+   if( todo.empty() ){
+       if (verbose) std::cerr << "no rows outside the times already in the cube" << std::endl;
+       return;
+   }
+   // one set of fill threads for the whole load, rather than a set for each block of rows
+   std::unique_ptr<WorkerPool> pool( m_nthreads>1? new WorkerPool(m_nthreads) : 0 );
+   struct PoolScope {
+       Exposure& e;
+       PoolScope(Exposure& ex, WorkerPool* p): e(ex){ e.m_pool=p; }
+       ~PoolScope(){ e.m_pool=0; }
+   } scope(*this, pool.get());
 
-   for (long irow = 0; it != scData->end(); ++it, ++irow) {
-      if (verbose && (irow % (nrows/20)) == 0 ) std::cerr << ".";
-      if( processEntry( row, gti) )break;
+   GTIindex index(todo);
+   std::unique_ptr<PointingGrid> grid( m_aggregation>0? new PointingGrid(m_aggregation) : 0 );
+   std::function<bool(std::vector<PointingRow>&)> consume = [this, &grid](std::vector<PointingRow>& rows){
+       if( grid.get()!=0 ){
+           // sum the rows into their cells: the cells are filled at the end
+           for( std::vector<PointingRow>::const_iterator r=rows.begin(); r!=rows.end(); ++r) grid->add(*r);
+       }else{
+           fill_rows(rows);
+       }
+       return true;
+   };
+
+   if( m_queuedepth==0 ){
+       read(scData, index, verbose, consume);
+   }else{
+       // a reader thread decodes the table into the queue while this one fills
+       BoundedQueue<std::vector<PointingRow> > queue(m_queuedepth);
+       std::exception_ptr error;
+       std::thread reader([&](){
+           try{
+               read(scData, index, verbose, [&queue](std::vector<PointingRow>& rows){ return queue.push(rows); });
+           }catch(...){
+               error = std::current_exception();
+           }
+           queue.close();
+       });
+       try{
+           std::vector<PointingRow> rows;
+           while( queue.pop(rows) ) consume(rows);
+       }catch(...){
+           queue.close(); // let the reader stop
+           reader.join();
+           throw;
+       }
+       reader.join();
+       if( error ) std::rethrow_exception(error);
+   }
+
+   if( grid.get()!=0 ){
+       std::vector<PointingRow> cells(grid->rows());
+       m_aggregated_rows = grid->added();
+       m_aggregated_cells = cells.size();
+       size_t step(std::max<size_t>(m_batchsize, 1));
+       for( size_t first=0; first<cells.size(); first+=step){
+           fill_rows(std::vector<PointingRow>(cells.begin()+first, cells.begin()+std::min(first+step, cells.size())));
+       }
    }
+   // only now that every row is in: a load that throws must not claim the times
+   m_coverage.add(todo);
+   // a weighted exposure filled in the same pass includes the same times
+   if( m_companion!=0 ) m_companion->m_coverage.add(todo);
    if (verbose) std::cerr << "!" << std::endl;
 }
 
+void Exposure::load(const tip::Table * scData, Exposure& weighted,
+                    const GTIvector& gti, 
+                    bool verbose) {
+    if( weighted.m_dir_cache.size()!=m_dir_cache.size() ){
+        throw std::invalid_argument("Exposure::load: weighted exposure has different binning");
+    }
+    m_companion = &weighted;
+    try {
+        load(scData, gti, verbose);
+    }catch(...){
+        m_companion=0;
+        throw;
+    }
+    m_companion=0;
+}
+
 
-bool Exposure::processEntry(const tip::ConstTableRecord & row, const GTIvector& gti)
+bool Exposure::processEntry(const PointingColumns& block, size_t i, GTIindex& gti, std::vector<PointingRow>& rows)
 {
     using astro::SkyDir;
+    using CLHEP::Hep3Vector;
 
-    double  start, stop, livetime; 
-    row["livetime"].get(livetime);
+    double  start(block.start[i]), stop(block.stop[i]), livetime(block.livetime[i]); 
     if(livetime==0 ) return false; // assume this takes care of any entries during SAA
-    row["start"].get(start);
-    row["stop"].get(stop);
     double deltat = livetime; 
 
 
-    double fraction(1); 
-    bool  done(false);
-    if( !gti.empty() ) {
-        fraction = 0;
-
-        GTIvector::const_iterator it  = gti.begin();
-        for ( ; it != gti.end(); ++it) {
-            double first = it->first,
-                second=it->second;
-
-            if( start < first ) {
-                if( stop < first) continue; // history interval before gti
-                if( stop <= second){
-                    fraction = (stop-first)/(stop-start); // overlap start of gti
-                    break;
-                }
-                fraction = (second-first)/(stop-start); // gti subset of history
-                break;
-            }else {
-                if( start > second) continue; // interval after gti 
-                if( stop <= second ) {
-                    fraction = 1.0; break;  // fully contained
-                }
-                fraction = (second-start)/(stop-start);  // overlap end of gti
-                break;
-            }
- 
-        }
-        done = fraction==0 && start > gti.back().second; 
-    }
+    // overlap with the good-time intervals, summed if the row spans more than one
+    double fraction( gti.fraction(start, stop) ); 
+    bool  done( fraction==0 && gti.after(start) );
     if( fraction>0. ) {
         deltat *= fraction; // reduce if a boundary
-        double ra, dec, razenith, deczenith;
-        row["ra_scz"].get(ra);
-        row["dec_scz"].get(dec);
-        SkyDir scz(ra, dec);
-        row["ra_scx"].get(ra);
-        row["dec_scx"].get(dec);
-        SkyDir scx(ra, dec);
-	row["ra_zenith"].get(razenith);
-	row["dec_zenith"].get(deczenith);
-        SkyDir zenith(razenith, deczenith);
+        SkyDir scz(Hep3Vector(block.zx[i], block.zy[i], block.zz[i])),
+               scx(Hep3Vector(block.xx[i], block.xy[i], block.xz[i])),
+               zenith(Hep3Vector(block.nx[i], block.ny[i], block.nz[i]));
+        // time for a weighted exposure filled at the same time
+        double wdeltat( deltat*livetime/(stop-start) );
         if( m_weighted ){
             // adjust time by multiplying by livetime fraction
-            deltat *= livetime/(stop-start);
+            deltat = wdeltat;
         }
-        fill_zenith(scz, scx,  zenith, deltat);
+        rows.push_back(PointingRow(scz, scx, zenith, deltat, wdeltat));
     }
     return done; 
 
 }
-
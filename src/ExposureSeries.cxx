@@ -0,0 +1,127 @@
+/** @file ExposureSeries.cxx
+    @brief Implementation of class ExposureSeries
+
+   $Header$
+*/
+#include "map_tools/ExposureSeries.h"
+#include "map_tools/PointingColumns.h"
+#include "tip/IFileSvc.h"
+#include "tip/Table.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+using namespace map_tools;
+using CLHEP::Hep3Vector;
+
+ExposureSeries::ExposureSeries(const std::vector<double>& edges, const std::string& outputfile,
+                               double pixelsize, double cosbinsize, double zcut, size_t maxcubes)
+: m_outputfile(outputfile)
+, m_tablename("Exposure"), m_tablename2("WEIGHTED_EXPOSURE")
+, m_pixelsize(pixelsize), m_cosbinsize(cosbinsize), m_zcut(zcut)
+, m_maxcubes(maxcubes)
+, m_nthreads(1)
+, m_batchsize(1)
+, m_written(0)
+, m_total(0)
+{
+    if( edges.size()<2 ) throw std::invalid_argument("ExposureSeries: need at least two bin edges");
+    for( size_t k=0; k+1<edges.size(); ++k){
+        if( !(edges[k]<edges[k+1]) ) throw std::invalid_argument("ExposureSeries: bin edges must increase");
+        m_bins.push_back(Bin(edges[k], edges[k+1]));
+    }
+}
+
+void ExposureSeries::create(Bin& bin)
+{
+    if( bin.ex.get()!=0 ) return;
+    bin.ex.reset(new Exposure(m_pixelsize, m_cosbinsize, m_zcut));
+    bin.ex2.reset(new Exposure(m_pixelsize, m_cosbinsize, m_zcut, true));
+    bin.ex->setThreads(m_nthreads);
+}
+
+void ExposureSeries::flush(Bin& bin)
+{
+    if( bin.rows.empty() ) return;
+    create(bin);
+    // the time the zenith cut leaves, as Exposure::load reports it
+    double before(bin.ex->total());
+    bin.ex->fill_batch(bin.rows, bin.ex2.get());
+    m_total += bin.ex->total()-before;
+    bin.rows.clear();
+}
+
+void ExposureSeries::close(size_t k)
+{
+    flush(m_bins[k]);
+    m_bins[k].finished = true;
+    // write the oldest finished bins, in order, while more than m_maxcubes are held
+    size_t held(0);
+    for( size_t j=m_written; j<m_bins.size() && m_bins[j].finished; ++j) ++held;
+    while( held > m_maxcubes ){
+        write(m_written);
+        --held;
+    }
+}
+
+void ExposureSeries::write(size_t k)
+{
+    Bin& bin(m_bins[k]);
+    create(bin); // a bin that no row reached gets an empty cube
+    std::ostringstream suffix; suffix << "_" << k;
+    std::string table(m_tablename+suffix.str()), table2(m_tablename2+suffix.str());
+    bin.ex->write(m_outputfile, table, k==0);
+    bin.ex2->write(m_outputfile, table2, false);
+    const std::string* names[] = {&table, &table2};
+    for( int i=0; i<2; ++i){
+        std::unique_ptr<tip::Table> t(tip::IFileSvc::instance().editTable(m_outputfile, *names[i]));
+        t->getHeader()["TSTART"].set(bin.start);
+        t->getHeader()["TSTOP"].set(bin.stop);
+    }
+    bin.ex.reset();
+    bin.ex2.reset();
+    m_written = k+1;
+}
+
+void ExposureSeries::load(const tip::Table * scData, const Exposure::GTIvector& gti)
+{
+    static const size_t columnblock(4096);
+    GTIindex index(gti);
+    PointingColumns columns(scData);
+    size_t cursor(m_written); // first bin that is not finished
+    while( cursor<m_bins.size() && m_bins[cursor].finished ) ++cursor;
+
+    for( long first=0; first<columns.rows(); first+=columnblock){
+        size_t n(columns.read(first, columnblock));
+        for( size_t i=0; i<n; ++i){
+            double start(columns.start[i]), stop(columns.stop[i]), livetime(columns.livetime[i]);
+            // bins that end before this row are done
+            while( cursor<m_bins.size() && m_bins[cursor].stop <= start ) close(cursor++);
+            if( cursor==m_bins.size() ) return;
+            if( livetime==0 || stop<=start ) continue;
+
+            Hep3Vector z(columns.zx[i], columns.zy[i], columns.zz[i]),
+                       x(columns.xx[i], columns.xy[i], columns.xz[i]),
+                       zen(columns.nx[i], columns.ny[i], columns.nz[i]);
+            // split the row at the bin edges, and each part by the good-time intervals
+            for( size_t k=cursor; k<m_bins.size() && m_bins[k].start < stop; ++k){
+                Bin& bin(m_bins[k]);
+                double lo(std::max(start, bin.start)), hi(std::min(stop, bin.stop));
+                if( lo>=hi ) continue;
+                double deltat( livetime * index.fraction(lo, hi)*(hi-lo)/(stop-start) );
+                if( deltat<=0 ) continue;
+                bin.rows.push_back(Exposure::PointingRow(astro::SkyDir(z), astro::SkyDir(x), astro::SkyDir(zen),
+                    deltat, deltat*livetime/(stop-start)));
+                if( bin.rows.size() >= std::max<size_t>(m_batchsize, 1) ) flush(bin);
+            }
+        }
+    }
+    for( size_t k=cursor; k<m_bins.size(); ++k) flush(m_bins[k]);
+}
+
+void ExposureSeries::finish()
+{
+    for( size_t k=m_written; k<m_bins.size(); ++k) flush(m_bins[k]);
+    while( m_written<m_bins.size() ) write(m_written);
+}
@@ -0,0 +1,204 @@
+/** @file FillKernels.cxx
+    @brief implement the pixel classification kernels: AVX-512, AVX2, or a scalar fallback,
+    selected by the instruction set the file is compiled for
+
+    $Header$
+*/
+#include "FillKernels.h"
+#include "healpix/CosineBinner.h"
+
+#include <algorithm>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+using healpix::CosineBinner;
+
+namespace map_tools {
+namespace kernels {
+
+CosineBins::CosineBins()
+: m_range(1.-CosineBinner::cosmin())
+, m_nbins(static_cast<double>(CosineBinner::nbins()))
+, m_count(static_cast<int>(CosineBinner::nbins()))
+, m_sqrt_weight(CosineBinner::thetaBinning()=="SQRT(1-COSTHETA)")
+{}
+
+PhiBins::PhiBins()
+: m_count(static_cast<int>(CosineBinner::nphibins()))
+{
+    for( int k=1; k<m_count; ++k){
+        m_tan.push_back(std::tan(M_PI/4*k/m_count));
+    }
+}
+
+void classify_phi(const double* x, const double* y, const double* z, std::size_t n,
+                  const Pointing& p, const CosineBins& cb, const PhiBins& pb, int* bins, int* phibins)
+{
+    // no branches on the data, so that the compiler can vectorize the loop
+    for( std::size_t i=0; i<n; ++i){
+        double u( p.rotx[0]*x[i] + p.rotx[1]*y[i] + p.rotx[2]*z[i] ),
+               v( p.roty[0]*x[i] + p.roty[1]*y[i] + p.roty[2]*z[i] ),
+               w( p.rotz[0]*x[i] + p.rotz[1]*y[i] + p.rotz[2]*z[i] );
+        int bin(cb.index(w));
+        bins[i] = bins[i]<0? -1 : bin;
+        phibins[i] = pb.index(u, v);
+    }
+}
+
+namespace {
+    /// reference version, also used for the pixels left over by the vector loops
+    inline void classify_scalar(const double* x, const double* y, const double* z,
+                                std::size_t first, std::size_t n,
+                                const Pointing& p, const CosineBins& cb, int* bins)
+    {
+        for( std::size_t i=first; i<n; ++i){
+            if( p.zcut ){
+                double zen( x[i]*p.zenith[0] + y[i]*p.zenith[1] + z[i]*p.zenith[2] );
+                if( !(zen > p.zmin && zen < p.zmax) ){
+                    bins[i] = -1; continue;
+                }
+            }
+            bins[i] = cb.index( x[i]*p.dirz[0] + y[i]*p.dirz[1] + z[i]*p.dirz[2] );
+        }
+    }
+}
+
+#if defined(__AVX512F__)
+
+namespace {
+    /// c[l] += g*b[l] for l=0..n-1
+    inline void axpy(double g, const double* b, double* c, std::size_t n)
+    {
+        const __m512d G(_mm512_set1_pd(g));
+        std::size_t l(0);
+        for( ; l+8<=n; l+=8){
+            _mm512_storeu_pd(c+l, _mm512_add_pd(_mm512_loadu_pd(c+l), _mm512_mul_pd(G, _mm512_loadu_pd(b+l))));
+        }
+        for( ; l<n; ++l) c[l] += g*b[l];
+    }
+}
+
+void classify(const double* x, const double* y, const double* z, std::size_t n,
+              const Pointing& p, const CosineBins& cb, int* bins)
+{
+    const __m512d dx(_mm512_set1_pd(p.dirz[0])), dy(_mm512_set1_pd(p.dirz[1])), dz(_mm512_set1_pd(p.dirz[2])),
+        zx(_mm512_set1_pd(p.zenith[0])), zy(_mm512_set1_pd(p.zenith[1])), zz(_mm512_set1_pd(p.zenith[2])),
+        zmin(_mm512_set1_pd(p.zmin)), zmax(_mm512_set1_pd(p.zmax)),
+        one(_mm512_set1_pd(1.)), zero(_mm512_setzero_pd()),
+        range(_mm512_set1_pd(cb.range())), nbins(_mm512_set1_pd(cb.nbins()));
+    const __m256i rejected(_mm256_set1_epi32(-1));
+    std::size_t i(0);
+    for( ; i+8<=n; i+=8){
+        __m512d X(_mm512_loadu_pd(x+i)), Y(_mm512_loadu_pd(y+i)), Z(_mm512_loadu_pd(z+i));
+        // same order of operations as the scalar version, and no FMA, so the results agree
+        __m512d c = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(X,dx), _mm512_mul_pd(Y,dy)), _mm512_mul_pd(Z,dz));
+        __m512d f = _mm512_div_pd(_mm512_sub_pd(one, c), range);
+        f = _mm512_min_pd(_mm512_max_pd(f, zero), one);
+        if( cb.sqrt_weight() ) f = _mm512_sqrt_pd(f);
+        __mmask8 ok(0xff);
+        if( p.zcut ){
+            __m512d zen = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(X,zx), _mm512_mul_pd(Y,zy)), _mm512_mul_pd(Z,zz));
+            ok = _mm512_cmp_pd_mask(zen, zmin, _CMP_GT_OQ) & _mm512_cmp_pd_mask(zen, zmax, _CMP_LT_OQ);
+        }
+        // the pixels that fail the zenith cut keep the value -1
+        __m256i bin = _mm512_mask_cvttpd_epi32(rejected, ok, _mm512_mul_pd(f, nbins));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(bins+i), bin);
+    }
+    classify_scalar(x, y, z, i, n, p, cb, bins);
+}
+
+const char* instructionSet(){ return "AVX-512"; }
+
+#elif defined(__AVX2__)
+
+namespace {
+    /// c[l] += g*b[l] for l=0..n-1
+    inline void axpy(double g, const double* b, double* c, std::size_t n)
+    {
+        const __m256d G(_mm256_set1_pd(g));
+        std::size_t l(0);
+        for( ; l+4<=n; l+=4){
+            _mm256_storeu_pd(c+l, _mm256_add_pd(_mm256_loadu_pd(c+l), _mm256_mul_pd(G, _mm256_loadu_pd(b+l))));
+        }
+        for( ; l<n; ++l) c[l] += g*b[l];
+    }
+}
+
+void classify(const double* x, const double* y, const double* z, std::size_t n,
+              const Pointing& p, const CosineBins& cb, int* bins)
+{
+    const __m256d dx(_mm256_set1_pd(p.dirz[0])), dy(_mm256_set1_pd(p.dirz[1])), dz(_mm256_set1_pd(p.dirz[2])),
+        zx(_mm256_set1_pd(p.zenith[0])), zy(_mm256_set1_pd(p.zenith[1])), zz(_mm256_set1_pd(p.zenith[2])),
+        zmin(_mm256_set1_pd(p.zmin)), zmax(_mm256_set1_pd(p.zmax)),
+        one(_mm256_set1_pd(1.)), zero(_mm256_setzero_pd()),
+        range(_mm256_set1_pd(cb.range())), nbins(_mm256_set1_pd(cb.nbins()));
+    const __m128i rejected(_mm_set1_epi32(-1));
+    std::size_t i(0);
+    for( ; i+4<=n; i+=4){
+        __m256d X(_mm256_loadu_pd(x+i)), Y(_mm256_loadu_pd(y+i)), Z(_mm256_loadu_pd(z+i));
+        // same order of operations as the scalar version, and no FMA, so the results agree
+        __m256d c = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(X,dx), _mm256_mul_pd(Y,dy)), _mm256_mul_pd(Z,dz));
+        __m256d f = _mm256_div_pd(_mm256_sub_pd(one, c), range);
+        f = _mm256_min_pd(_mm256_max_pd(f, zero), one);
+        if( cb.sqrt_weight() ) f = _mm256_sqrt_pd(f);
+        __m128i bin = _mm256_cvttpd_epi32(_mm256_mul_pd(f, nbins));
+        if( p.zcut ){
+            __m256d zen = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(X,zx), _mm256_mul_pd(Y,zy)), _mm256_mul_pd(Z,zz));
+            __m256d ok = _mm256_and_pd(_mm256_cmp_pd(zen, zmin, _CMP_GT_OQ), _mm256_cmp_pd(zen, zmax, _CMP_LT_OQ));
+            // pack the 64-bit lane mask down to 32 bits per pixel
+            __m128i ok32 = _mm256_castsi256_si128( _mm256_permutevar8x32_epi32(
+                _mm256_castpd_si256(ok), _mm256_setr_epi32(0,2,4,6,1,3,5,7)) );
+            bin = _mm_blendv_epi8(rejected, bin, ok32);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bins+i), bin);
+    }
+    classify_scalar(x, y, z, i, n, p, cb, bins);
+}
+
+const char* instructionSet(){ return "AVX2"; }
+
+#else
+
+namespace {
+    /// c[l] += g*b[l] for l=0..n-1
+    inline void axpy(double g, const double* b, double* c, std::size_t n)
+    {
+        for( std::size_t l=0; l<n; ++l) c[l] += g*b[l];
+    }
+}
+
+void classify(const double* x, const double* y, const double* z, std::size_t n,
+              const Pointing& p, const CosineBins& cb, int* bins)
+{
+    classify_scalar(x, y, z, 0, n, p, cb, bins);
+}
+
+const char* instructionSet(){ return "scalar"; }
+
+#endif
+
+void product(const float* const* a, std::size_t n, std::size_t nk,
+             const double* b, std::size_t nl, double* c)
+{
+    // 32 rows of c, and 64 rows of b, fit in the L1 cache for up to about 40 columns
+    const std::size_t rowblock(32), kblock(64);
+    std::fill(c, c+n*nl, 0.);
+    for( std::size_t i0=0; i0<n; i0+=rowblock){
+        std::size_t i1(std::min(n, i0+rowblock));
+        for( std::size_t k0=0; k0<nk; k0+=kblock){
+            std::size_t k1(std::min(nk, k0+kblock));
+            for( std::size_t i=i0; i<i1; ++i){
+                const float* row(a[i]);
+                double* ci(c+i*nl);
+                for( std::size_t k=k0; k<k1; ++k){
+                    if( row[k]==0 ) continue; // empty bins are common: outside the zenith cut, or phi bins
+                    axpy(row[k], b+k*nl, ci, nl);
+                }
+            }
+        }
+    }
+}
+
+}} // namespace map_tools::kernels
@@ -0,0 +1,116 @@
+/** @file FillKernels.h
+    @brief declare the pixel classification kernels used by Exposure to fill its CosineBinner objects,
+    and the matrix product used by LayerExposure to evaluate them
+
+    $Header$
+*/
+#ifndef MAP_TOOLS_FILLKERNELS_H
+#define MAP_TOOLS_FILLKERNELS_H
+
+#include <cstddef>
+#include <cmath>
+#include <vector>
+
+namespace map_tools {
+namespace kernels {
+
+/** @class CosineBins
+    @brief copy of the static cos(theta) binning of healpix::CosineBinner, for the kernels
+*/
+class CosineBins {
+public:
+    CosineBins(); ///< copy the current binning
+
+    //! @return index of the bin for costheta, or count() if it is below cosmin
+    int index(double costheta)const
+    {
+        double f( (1.-costheta)/m_range );
+        if( f<0 ) f=0;      // round-off for a pixel on the axis
+        else if( f>1 ) f=1; // will be count()
+        if( m_sqrt_weight ) f = std::sqrt(f);
+        return static_cast<int>(f*m_nbins);
+    }
+    int count()const{return m_count;}
+    double range()const{return m_range;}
+    double nbins()const{return m_nbins;}
+    bool sqrt_weight()const{return m_sqrt_weight;}
+
+private:
+    double m_range;  ///< 1-cosmin
+    double m_nbins;
+    int    m_count;
+    bool   m_sqrt_weight;
+};
+
+/** @class PhiBins
+    @brief the phi binning of healpix::CosineBinner, without trig
+
+    CosineBinner folds phi into the first octant, [0, 45) degrees, and divides that into
+    nphibins() equal bins. The folded angle has tangent min(|x|,|y|)/max(|x|,|y|) for the
+    instrument components x and y, so the bin is found by comparing with the tangents of
+    the bin boundaries.
+*/
+class PhiBins {
+public:
+    PhiBins(); ///< copy the current number of phi bins
+
+    //! @return the phi bin of a direction with instrument components x, y
+    int index(double x, double y)const
+    {
+        double ax(std::fabs(x)), ay(std::fabs(y));
+        double lo(ax<ay? ax : ay), hi(ax<ay? ay : ax);
+        int bin(0);
+        for( int k=0; k<m_count-1; ++k){
+            bin += lo>0 && lo >= hi*m_tan[k];
+        }
+        return bin;
+    }
+    int count()const{return m_count;}
+
+private:
+    int m_count;
+    std::vector<double> m_tan; ///< tangents of the upper edges of the first count()-1 bins
+};
+
+/** @class Pointing
+    @brief the directions needed to classify the pixels for one pointing
+*/
+struct Pointing {
+    double dirz[3];   ///< instrument z-axis
+    double zenith[3]; ///< local zenith
+    bool   zcut;      ///< true to apply the zenith cut
+    double zmin, zmax;///< allowed range of cos(zenith angle), exclusive
+    double rotx[3], roty[3], rotz[3]; ///< rows of the rotation to instrument coordinates, for phi
+};
+
+/** @brief classify the pixels with directions (x[i],y[i],z[i]), i=0..n-1
+    @param bins set, for each pixel, to -1 if it fails the zenith cut; otherwise to the
+      index of its cos(theta) bin, which is cb.count() if it is outside the binner range
+*/
+void classify(const double* x, const double* y, const double* z, std::size_t n,
+              const Pointing& p, const CosineBins& cb, int* bins);
+
+/** @brief find the cos(theta) and phi bins, in instrument coordinates, of the pixels that classify accepted
+    @param bins as set by classify. Pixels with -1 are left alone; the others are set to the
+      cos(theta) bin of the rotated direction, which is cb.count() if it is outside the binner range
+    @param phibins set, for each pixel, to its phi bin
+*/
+void classify_phi(const double* x, const double* y, const double* z, std::size_t n,
+                  const Pointing& p, const CosineBins& cb, const PhiBins& pb, int* bins, int* phibins);
+
+/** @brief the matrix product c = a b, for n rows of a given by pointers
+    @param a pointers to the rows of a, each with at least nk values
+    @param b nk by nl matrix, stored by rows
+    @param c set to the n by nl product, stored by rows
+    The rows are taken in blocks, and b in slices of rows that stay in the L1 cache while the
+    block is applied to them; zero elements of a are skipped. Each element of c is summed in
+    order of k, so the result is the same for every instruction set.
+*/
+void product(const float* const* a, std::size_t n, std::size_t nk,
+             const double* b, std::size_t nl, double* c);
+
+//! @return the name of the instruction set that the kernels were compiled for
+const char* instructionSet();
+
+}} // namespace map_tools::kernels
+#endif
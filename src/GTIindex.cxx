@@ -0,0 +1,95 @@
+/** @file GTIindex.cxx
+    @brief Implementation of class GTIindex
+
+   $Header$
+*/
+#include "map_tools/GTIindex.h"
+
+#include <algorithm>
+
+using namespace map_tools;
+
+namespace {
+    /// order intervals by the end time, for the binary search
+    bool ends_before(const std::pair<double,double>& gti, double time){ return gti.second <= time; }
+}
+
+GTIindex::GTIindex(const GTIvector& gti)
+: m_gti(gti)
+, m_cursor(0)
+{
+    merge();
+}
+
+void GTIindex::add(const GTIvector& gti)
+{
+    m_gti.insert(m_gti.end(), gti.begin(), gti.end());
+    merge();
+}
+
+void GTIindex::merge()
+{
+    std::sort(m_gti.begin(), m_gti.end());
+    GTIvector merged;
+    for( GTIvector::const_iterator it=m_gti.begin(); it!=m_gti.end(); ++it){
+        if( !merged.empty() && it->first <= merged.back().second ){
+            merged.back().second = std::max(merged.back().second, it->second);
+        }else{
+            merged.push_back(*it);
+        }
+    }
+    m_gti.swap(merged);
+    m_cursor = 0;
+}
+
+double GTIindex::fraction(double start, double stop)
+{
+    if( m_gti.empty() ) return 1.0;
+
+    // find the first interval that ends after start: step forward for time-ordered
+    // queries, binary search if this one starts before the last
+    if( m_cursor>0 && m_gti[m_cursor-1].second > start ){
+        m_cursor = std::lower_bound(m_gti.begin(), m_gti.end(), start, ends_before) - m_gti.begin();
+    }else{
+        while( m_cursor < m_gti.size() && m_gti[m_cursor].second <= start) ++m_cursor;
+    }
+
+    if( stop <= start ) {
+        // no length: in or out
+        return m_cursor < m_gti.size() && m_gti[m_cursor].first <= start ? 1.0 : 0.0;
+    }
+
+    // sum the overlap with each interval that starts before stop
+    double overlap(0);
+    for( size_t k=m_cursor; k < m_gti.size() && m_gti[k].first < stop; ++k){
+        overlap += std::min(stop, m_gti[k].second) - std::max(start, m_gti[k].first);
+    }
+    return overlap/(stop-start);
+}
+
+GTIindex::GTIvector GTIindex::subtract(const GTIvector& gti)const
+{
+    GTIvector result;
+    GTIindex other(gti);
+    for( GTIvector::const_iterator it=other.m_gti.begin(); it!=other.m_gti.end(); ++it){
+        double start(it->first);
+        // step over the intervals of this one that overlap [start, it->second]
+        size_t k = std::lower_bound(m_gti.begin(), m_gti.end(), start, ends_before) - m_gti.begin();
+        for( ; k < m_gti.size() && m_gti[k].first < it->second; ++k){
+            if( m_gti[k].first > start ) result.push_back(std::make_pair(start, m_gti[k].first));
+            start = std::max(start, m_gti[k].second);
+        }
+        if( start < it->second ) result.push_back(std::make_pair(start, it->second));
+    }
+    return result;
+}
+
+GTIindex::GTIvector GTIindex::clip(double start, double stop)const
+{
+    GTIvector result;
+    for( GTIvector::const_iterator it=m_gti.begin(); it!=m_gti.end(); ++it){
+        double first(std::max(start, it->first)), last(std::min(stop, it->second));
+        if( first < last ) result.push_back(std::make_pair(first, last));
+    }
+    return result;
+}
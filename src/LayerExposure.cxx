@@ -0,0 +1,56 @@
+/** @file LayerExposure.cxx
+    @brief implement the class LayerExposure
+
+    $Header$
+*/
+#include "map_tools/LayerExposure.h"
+#include "FillKernels.h"
+
+#include <algorithm>
+
+using namespace map_tools;
+
+LayerExposure::LayerExposure(const Exposure& exp, const std::vector<BinnerTable>& aeff, double norm)
+: m_exp(exp)
+, m_layers(aeff.size())
+, m_bins(0)
+{
+    // the tables omit trailing bins with no coefficient, so are padded with zeros to the longest
+    for( std::vector<BinnerTable>::const_iterator it=aeff.begin(); it!=aeff.end(); ++it){
+        m_bins = std::max(m_bins, it->size());
+    }
+    if( exp.data().size()>0 ) m_bins = std::min(m_bins, exp.data()[0].size());
+    m_table.resize(m_bins*m_layers, 0.);
+    for( size_t k=0; k<m_layers; ++k){
+        const BinnerTable& table(aeff[k]);
+        for( size_t j=0; j<std::min(m_bins, table.size()); ++j){
+            m_table[j*m_layers+k] = norm*table[j];
+        }
+    }
+}
+
+void LayerExposure::operator()(const std::vector<astro::SkyDir>& dirs, std::vector<double>& values)const
+{
+    std::vector<const float*> rows(dirs.size());
+    for( size_t i=0; i<dirs.size(); ++i){
+        rows[i] = &*m_exp.data()[dirs[i]].begin();
+    }
+    product(rows, values);
+}
+
+void LayerExposure::operator()(const std::vector<long>& pix, std::vector<double>& values)const
+{
+    std::vector<const float*> rows(pix.size());
+    for( size_t i=0; i<pix.size(); ++i){
+        rows[i] = &*(m_exp.data().begin()+pix[i])->begin();
+    }
+    product(rows, values);
+}
+
+void LayerExposure::product(const std::vector<const float*>& rows, std::vector<double>& values)const
+{
+    values.resize(rows.size()*m_layers);
+    if( values.empty() ) return;
+    kernels::product(&rows[0], rows.size(), m_bins, 
+        m_table.empty()? 0 : &m_table[0], m_layers, &values[0]);
+}
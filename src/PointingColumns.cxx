@@ -0,0 +1,81 @@
+/** @file PointingColumns.cxx
+    @brief Implementation of class PointingColumns
+
+   $Header$
+*/
+#include "map_tools/PointingColumns.h"
+#include "tip/Table.h"
+#include "tip/IColumn.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace map_tools;
+
+PointingColumns::PointingColumns(const tip::Table * table)
+: m_rows(table->getNumRecords())
+{
+    static const char* names[NCOLUMNS] = {"start", "stop", "livetime", 
+        "ra_scz", "dec_scz", "ra_scx", "dec_scx", "ra_zenith", "dec_zenith"};
+    for( int i=0; i<NCOLUMNS; ++i){
+        m_columns[i] = table->getColumn(table->getFieldIndex(names[i]));
+    }
+}
+
+void PointingColumns::get(int column, long first, size_t count, std::vector<double>& values)const
+{
+    values.resize(count);
+    const tip::IColumn& col(*m_columns[column]);
+    for( size_t i=0; i<count; ++i){
+        col.get(first+i, values[i]);
+    }
+}
+
+void PointingColumns::convert(std::vector<double>& x, std::vector<double>& y, std::vector<double>& z)const
+{
+    static const double deg(M_PI/180);
+    size_t n(m_ra.size());
+    x.resize(n); y.resize(n); z.resize(n);
+    if( n==0 ) return;
+    const double* ra(&m_ra[0]), *dec(&m_dec[0]);
+    for( size_t i=0; i<n; ++i){
+        double cd( cos(dec[i]*deg) );
+        x[i] = cd*cos(ra[i]*deg);
+        y[i] = cd*sin(ra[i]*deg);
+        z[i] = sin(dec[i]*deg);
+    }
+}
+
+size_t PointingColumns::read(long first, size_t count)
+{
+    count = static_cast<size_t>(std::max(0L, std::min<long>(count, m_rows-first)));
+    get(START, first, count, start);
+    get(STOP, first, count, stop);
+    get(LIVETIME, first, count, livetime);
+
+    get(RA_SCZ, first, count, m_ra);    get(DEC_SCZ, first, count, m_dec);    convert(zx, zy, zz);
+    get(RA_SCX, first, count, m_ra);    get(DEC_SCX, first, count, m_dec);    convert(xx, xy, xz);
+    get(RA_ZENITH, first, count, m_ra); get(DEC_ZENITH, first, count, m_dec); convert(nx, ny, nz);
+    return count;
+}
+
+bool PointingColumns::span(double& tstart, double& tstop)const
+{
+    if( m_rows==0 ) return false;
+    m_columns[START]->get(0, tstart);
+    m_columns[STOP]->get(m_rows-1, tstop);
+    return true;
+}
+
+long PointingColumns::find(double time)const
+{
+    long lo(0), hi(m_rows);
+    while( lo<hi ){
+        long mid( lo+(hi-lo)/2 );
+        double stop;
+        m_columns[STOP]->get(mid, stop);
+        if( stop <= time ) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
@@ -0,0 +1,69 @@
+/** @file PointingGrid.cxx
+    @brief Implementation of class PointingGrid
+
+   $Header$
+*/
+#include "map_tools/PointingGrid.h"
+
+#include <cmath>
+#include <stdexcept>
+
+using namespace map_tools;
+
+PointingGrid::PointingGrid(double degrees)
+: m_step(degrees*M_PI/180)
+, m_added(0)
+{
+    if( !(m_step>0) ) throw std::invalid_argument("PointingGrid: step must be positive");
+}
+
+bool PointingGrid::Key::operator==(const Key& other)const
+{
+    for( int i=0; i<9; ++i) if( k[i]!=other.k[i] ) return false;
+    return true;
+}
+
+size_t PointingGrid::KeyHash::operator()(const Key& key)const
+{
+    size_t h(0);
+    for( int i=0; i<9; ++i) h = h*1000003 ^ static_cast<size_t>(key.k[i]);
+    return h;
+}
+
+void PointingGrid::quantize(const CLHEP::Hep3Vector& dir, Key& key, int first)const
+{
+    key.k[first]   = static_cast<long>(floor(dir.x()/m_step));
+    key.k[first+1] = static_cast<long>(floor(dir.y()/m_step));
+    key.k[first+2] = static_cast<long>(floor(dir.z()/m_step));
+}
+
+void PointingGrid::add(const PointingRow& row)
+{
+    Key key;
+    quantize(row.dirz(), key, 0);
+    quantize(row.dirx(), key, 3);
+    quantize(row.zenith(), key, 6);
+    std::pair<std::unordered_map<Key, size_t, KeyHash>::iterator, bool> 
+        found( m_index.insert(std::make_pair(key, m_cells.size())) );
+    if( found.second ) m_cells.push_back(Cell());
+    Cell& cell(m_cells[found.first->second]);
+    cell.z      += row.deltat*row.dirz();
+    cell.x      += row.deltat*row.dirx();
+    cell.zenith += row.deltat*row.zenith();
+    cell.deltat += row.deltat;
+    cell.wdeltat+= row.wdeltat;
+    ++m_added;
+}
+
+std::vector<PointingGrid::PointingRow> PointingGrid::rows()const
+{
+    std::vector<PointingRow> result;
+    result.reserve(m_cells.size());
+    for( std::vector<Cell>::const_iterator it=m_cells.begin(); it!=m_cells.end(); ++it){
+        if( it->deltat<=0 ) continue;
+        result.push_back(PointingRow(
+            astro::SkyDir(it->z.unit()), astro::SkyDir(it->x.unit()), astro::SkyDir(it->zenith.unit()),
+            it->deltat, it->wdeltat));
+    }
+    return result;
+}
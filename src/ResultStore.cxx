@@ -0,0 +1,128 @@
+/** @file ResultStore.cxx
+    @brief implement the class ResultStore
+
+    $Header$
+*/
+#include "map_tools/ResultStore.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <utility>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <utime.h>
+#include <unistd.h>
+
+using namespace map_tools;
+
+namespace {
+    const std::string prefix("result_"), suffix(".fits");
+
+    //! copy a file, through a temporary name so that a partial copy is never seen
+    void copy(const std::string& from, const std::string& to)
+    {
+        std::ostringstream temp;
+        temp << to << ".tmp" << getpid();
+        {
+            std::ifstream in(from.c_str(), std::ios::binary);
+            std::ofstream out(temp.str().c_str(), std::ios::binary);
+            if( !in ) throw std::runtime_error("ResultStore: could not read "+from);
+            out << in.rdbuf();
+            if( !out ) throw std::runtime_error("ResultStore: could not write "+temp.str());
+        }
+        if( rename(temp.str().c_str(), to.c_str())!=0 ){
+            std::remove(temp.str().c_str());
+            throw std::runtime_error("ResultStore: could not replace "+to);
+        }
+    }
+
+    /// the saved files, with their sizes and modification times
+    struct Saved {
+        std::string name;
+        double size;
+        time_t mtime;
+        bool operator<(const Saved& other)const{return mtime<other.mtime;}
+    };
+    std::vector<Saved> list(const std::string& directory)
+    {
+        std::vector<Saved> files;
+        DIR* dir = opendir(directory.c_str());
+        if( dir==0 ) return files;
+        while( struct dirent* entry = readdir(dir) ){
+            std::string name(entry->d_name);
+            if( name.size()<=prefix.size()+suffix.size() || name.compare(0, prefix.size(), prefix)!=0 
+                || name.compare(name.size()-suffix.size(), suffix.size(), suffix)!=0 ) continue;
+            struct stat info;
+            if( stat((directory+"/"+name).c_str(), &info)!=0 ) continue;
+            Saved s = { name, static_cast<double>(info.st_size), info.st_mtime };
+            files.push_back(s);
+        }
+        closedir(dir);
+        return files;
+    }
+}
+
+ResultStore::ResultStore(const std::string& directory, double maxsize, bool link)
+: m_directory(directory)
+, m_maxsize(maxsize)
+, m_link(link)
+{
+    if( mkdir(directory.c_str(), 0755)!=0 && errno!=EEXIST ){
+        throw std::runtime_error("ResultStore: could not create directory "+directory);
+    }
+}
+
+std::string ResultStore::path(const std::string& key)const
+{
+    return m_directory+"/"+prefix+key+suffix;
+}
+
+bool ResultStore::fetch(const std::string& key, const std::string& outfile, bool clobber)const
+{
+    std::string file(path(key));
+    if( access(file.c_str(), R_OK)!=0 ) return false;
+    if( !clobber && access(outfile.c_str(), F_OK)==0 ) return false;
+    if( std::remove(outfile.c_str())!=0 && errno!=ENOENT ){
+        throw std::runtime_error("ResultStore: cannot remove file "+outfile);
+    }
+    // a link shares the saved file, and is read-only; a copy belongs to the caller
+    if( !m_link || link(file.c_str(), outfile.c_str())!=0 ){
+        copy(file, outfile);
+    }
+    utime(file.c_str(), 0); // now the most recently used
+    return true;
+}
+
+void ResultStore::save(const std::string& key, const std::string& file)const
+{
+    std::string saved(path(key));
+    copy(file, saved);
+    chmod(saved.c_str(), 0444);
+    evict();
+}
+
+double ResultStore::size()const
+{
+    std::vector<Saved> files(list(m_directory));
+    double total(0);
+    for( std::vector<Saved>::const_iterator it=files.begin(); it!=files.end(); ++it) total += it->size;
+    return total;
+}
+
+void ResultStore::evict()const
+{
+    std::vector<Saved> files(list(m_directory));
+    std::sort(files.begin(), files.end());
+    double total(0);
+    for( std::vector<Saved>::const_iterator it=files.begin(); it!=files.end(); ++it) total += it->size;
+    // the newest file is kept even if it alone is over the limit
+    for( size_t i=0; i+1<files.size() && total>m_maxsize; ++i){
+        if( std::remove((m_directory+"/"+files[i].name).c_str())==0 ) total -= files[i].size;
+    }
+}
@@ -6,18 +6,22 @@ $Header: /nfs/slac/g/glast/ground/cvs/ScienceTools-scons/map_tools/src/SkyImage.
 
 #include "map_tools/SkyImage.h"
 #include "astro/SkyProj.h"
+#include "healpix/Healpix.h"
 #include "hoops/hoops_group.h"
 
 #include "tip/IFileSvc.h"
 #include "tip/Image.h"
 #include "tip/Table.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <cctype>
+#include <exception>
 #include <cmath>
 #include <memory>
 #include <stdexcept>
 #include <sstream>
+#include <thread>
 #include <errno.h> // to test result of std::remove()
 
 namespace {
@@ -36,6 +40,8 @@ SkyImage::SkyImage(const astro::SkyDir& center,
 , m_image(0)
 , m_save(true)
 , m_layer(0)
+, m_nthreads(1)
+, m_layout(LAYER_MAJOR)
 {
 
     if( fov>90) {
@@ -83,6 +89,8 @@ SkyImage::SkyImage(const hoops::IParGroup& pars)
 , m_imageData()
 , m_save(true)
 , m_layer(0)
+, m_nthreads(1)
+, m_layout(LAYER_MAJOR)
 , m_wcs(0)
 {
     using namespace astro;
@@ -91,10 +99,6 @@ SkyImage::SkyImage(const hoops::IParGroup& pars)
     std::string cm_file = pars["cmfile"];
     std::string uc_cm_file = cm_file;
     for ( std::string::iterator itor = uc_cm_file.begin(); itor != uc_cm_file.end(); ++itor) *itor = std::toupper(*itor);
-        
-    // determine how energy values are computed from bins using bincalc parameter.
-    std::string layer_calc = pars["bincalc"];
-    for ( std::string::iterator itor = layer_calc.begin(); itor != layer_calc.end(); ++itor) *itor = std::toupper(*itor);
 
     if ( "NONE" != uc_cm_file){
         // get as much info as possible from the count map
@@ -110,33 +114,8 @@ SkyImage::SkyImage(const hoops::IParGroup& pars)
         header["NAXIS2"].get(m_naxis2);
 
         // read energies associated with layers from ebounds extension of count map.
-        std::unique_ptr<const tip::Table> ebounds(tip::IFileSvc::instance().readTable(cm_file, "EBOUNDS"));
-
-        static double s_MeV_per_keV = .001;
-
-        if ( layer_calc == "CENTER"){
-            // compute energies using N central bin values from ebounds
-            m_naxis3 = ebounds->getNumRecords();
-            m_energy.resize(m_naxis3);
-            std::vector<double>::iterator out_itor = m_energy.begin();
-            for ( tip::Table::ConstIterator in_itor = ebounds->begin(); in_itor != ebounds->end(); ++in_itor, ++out_itor){
-                double e_min = (*in_itor)["E_MIN"].get();
-                double e_max = (*in_itor)["E_MAX"].get();
-                *out_itor = .5 * (e_max + e_min) * s_MeV_per_keV;
-            }
-        } else {
-            // compute energies using N + 1 edge bin values from ebounds
-            m_naxis3 = ebounds->getNumRecords() + 1;
-            m_energy.resize(m_naxis3);
-            tip::Table::ConstIterator last_in = ebounds->begin();
-            std::vector<double>::iterator out_itor = m_energy.begin();
-            for ( tip::Table::ConstIterator in_itor = ebounds->begin(); in_itor != ebounds->end(); ++in_itor, ++out_itor){
-                *out_itor = (*in_itor)["E_MIN"].get() * s_MeV_per_keV;
-                last_in = in_itor;
-            }
-            // get last bin edge from e_max column.
-            *out_itor = (*last_in)["E_MAX"].get() * s_MeV_per_keV;
-        }
+        m_energy = energies(pars);
+        m_naxis3 = m_energy.size();
 
         // size of image is now known, so initialize it.
         m_pixelCount = m_naxis1*m_naxis2*m_naxis3;
@@ -147,7 +126,6 @@ SkyImage::SkyImage(const hoops::IParGroup& pars)
         //
         m_naxis1 = pars["nxpix"];
         m_naxis2 = pars["nypix"];
-        int enumbins = pars["enumbins"];
         std::string ptype = pars["proj"];
         double pixelsize = pars["pixscale"];
 
@@ -181,33 +159,78 @@ SkyImage::SkyImage(const hoops::IParGroup& pars)
             crota2=pars["axisrot"];
         m_wcs = new astro::SkyProj( pars["proj"], crpix, crval, cdelt, crota2, galactic);
   
-        double emin = pars["emin"], emax = pars["emax"];
-
-        // compute logarithmic bin ratio for edges
-        std::vector<double> edge(enumbins+1);
-        const double eratio = std::exp(std::log(emax / emin) / enumbins);
-        double energy = emin;
-        for ( int ii = 0; ii != enumbins; ++ii, energy *= eratio){
-            edge[ii] = energy;
-        }
-        // prevent annoying round-off in the last bin
-        edge[enumbins] = emax;
+        m_energy = energies(pars);
+        m_naxis3 = m_energy.size();
+    }
+    setupImage(pars["outfile"],  pars["clobber"]);
+}
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+std::vector<double> SkyImage::energies(const hoops::IParGroup& pars)
+{
+    std::vector<double> energy;
+    // see if there is an input count map
+    std::string cm_file = pars["cmfile"];
+    std::string uc_cm_file = cm_file;
+    for ( std::string::iterator itor = uc_cm_file.begin(); itor != uc_cm_file.end(); ++itor) *itor = std::toupper(*itor);
+
+    // determine how energy values are computed from bins using bincalc parameter.
+    std::string layer_calc = pars["bincalc"];
+    for ( std::string::iterator itor = layer_calc.begin(); itor != layer_calc.end(); ++itor) *itor = std::toupper(*itor);
+
+    if ( "NONE" != uc_cm_file){
+        // read energies associated with layers from ebounds extension of count map.
+        std::unique_ptr<const tip::Table> ebounds(tip::IFileSvc::instance().readTable(cm_file, "EBOUNDS"));
+
+        static double s_MeV_per_keV = .001;
 
-        // handle different styles of energy output
         if ( layer_calc == "CENTER"){
-          // energies are taken at centers of bins
-          m_naxis3=enumbins;
-          m_energy.resize(m_naxis3);
-          for( int ii = 0; ii != enumbins; ++ii){
-            m_energy[ii] = .5 * (edge[ii] + edge[ii+1]);
-          }
-        }else{
-          // energies are taken at edges of bins
-          m_naxis3=enumbins+1;
-          m_energy=edge;
+            // compute energies using N central bin values from ebounds
+            energy.resize(ebounds->getNumRecords());
+            std::vector<double>::iterator out_itor = energy.begin();
+            for ( tip::Table::ConstIterator in_itor = ebounds->begin(); in_itor != ebounds->end(); ++in_itor, ++out_itor){
+                double e_min = (*in_itor)["E_MIN"].get();
+                double e_max = (*in_itor)["E_MAX"].get();
+                *out_itor = .5 * (e_max + e_min) * s_MeV_per_keV;
+            }
+        } else {
+            // compute energies using N + 1 edge bin values from ebounds
+            energy.resize(ebounds->getNumRecords() + 1);
+            tip::Table::ConstIterator last_in = ebounds->begin();
+            std::vector<double>::iterator out_itor = energy.begin();
+            for ( tip::Table::ConstIterator in_itor = ebounds->begin(); in_itor != ebounds->end(); ++in_itor, ++out_itor){
+                *out_itor = (*in_itor)["E_MIN"].get() * s_MeV_per_keV;
+                last_in = in_itor;
+            }
+            // get last bin edge from e_max column.
+            *out_itor = (*last_in)["E_MAX"].get() * s_MeV_per_keV;
         }
+        return energy;
     }
-    setupImage(pars["outfile"],  pars["clobber"]);
+    int enumbins = pars["enumbins"];
+    double emin = pars["emin"], emax = pars["emax"];
+
+    // compute logarithmic bin ratio for edges
+    std::vector<double> edge(enumbins+1);
+    const double eratio = std::exp(std::log(emax / emin) / enumbins);
+    double e = emin;
+    for ( int ii = 0; ii != enumbins; ++ii, e *= eratio){
+        edge[ii] = e;
+    }
+    // prevent annoying round-off in the last bin
+    edge[enumbins] = emax;
+
+    // handle different styles of energy output
+    if ( layer_calc == "CENTER"){
+      // energies are taken at centers of bins
+      energy.resize(enumbins);
+      for( int ii = 0; ii != enumbins; ++ii){
+        energy[ii] = .5 * (edge[ii] + edge[ii+1]);
+      }
+    }else{
+      // energies are taken at edges of bins
+      energy=edge;
+    }
+    return energy;
 }
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 void SkyImage::setupImage(const std::string& outputFile,  bool clobber)
@@ -234,6 +257,7 @@ void SkyImage::setupImage(const std::string& outputFile,  bool clobber)
 
     m_pixelCount = m_naxis1*m_naxis2*m_naxis3;
     m_imageData.resize(m_pixelCount);
+    m_stats.resize(m_naxis3);
 
     // fill the boundaries with NaN
     //if( pars.projType()!="CAR") clear();
@@ -241,9 +265,11 @@ void SkyImage::setupImage(const std::string& outputFile,  bool clobber)
     m_wcs->setKeywords(m_image->getHeader());
 }
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-SkyImage::SkyImage(const std::string& fits_file, const std::string& extension)
+SkyImage::SkyImage(const std::string& fits_file, const std::string& extension, Layout layout)
 : m_save(false)
 , m_layer(0)
+, m_nthreads(1)
+, m_layout(LAYER_MAJOR)
 , m_wcs(0)
 {
     // note expect the image to be float
@@ -255,10 +281,15 @@ SkyImage::SkyImage(const std::string& fits_file, const std::string& extension)
     header["NAXIS2"].get(m_naxis2);
     header["NAXIS3"].get(m_naxis3);
     m_pixelCount = m_naxis1*m_naxis2*m_naxis3;
+    m_stats.resize(m_naxis3);
 
     m_wcs = new astro::SkyProj(fits_file,1);
+    // set up the projection now, as a loaded image may be read from several threads
+    double x(1.0), y(1.0);
+    m_wcs->testpix2sph(x, y);
     // finally, read in the image: assume it is float
     dynamic_cast<tip::TypedImage<float>*>(m_image)->get(m_imageData);
+    setLayout(layout);
 
 }
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -278,7 +309,7 @@ bool SkyImage::addPoint(const astro::SkyDir& dir, double delta, unsigned int lay
     unsigned int 
         i = static_cast<unsigned int>(p.first),
         j = static_cast<unsigned int>(p.second),
-        k = i+m_naxis1*(j + layer*m_naxis2);
+        k = offset(i+m_naxis1*j, layer);
     
     if(  k< m_pixelCount){
         m_imageData[k] += delta;
@@ -300,27 +331,179 @@ void SkyImage::checkLayer(unsigned int layer)const
 void SkyImage::fill(const astro::SkyFunction& req, unsigned int layer)
 {
     checkLayer(layer);
-    m_total=m_count=m_sumsq=0;
-    m_min=1e20;m_max=-1e10;
-    int offset = m_naxis1* m_naxis2 * layer;
-    for( size_t k = 0; k< (unsigned int)(m_naxis1)*(m_naxis2); ++k){
-        // determine the bin center (pixel coords start at (1,1) in center of lower left
-        double 
-            x = static_cast<int>(k%m_naxis1)+1.0, 
-            y = static_cast<int>(k/m_naxis1)+1.0,
-            t = dnan;  // default value: nan
-        if( m_wcs->testpix2sph(x,y)==0) {
-            astro::SkyDir dir(x,y, *m_wcs);
-            t= req(dir);
-            m_total += t;
-            ++m_count;
-            m_sumsq += t*t;
-            m_min = t<m_min? t:m_min;
-            m_max = t>m_max? t:m_max;
+    geometry();
+    std::vector<Statistics> stats(std::max(1u, m_nthreads));
+    for_rows([&](int first, int last, size_t i){ fill_rows(req, layer, first, last, stats[i]); });
+    // merge in row order so that the statistics do not depend on scheduling
+    Statistics& merged(m_stats[layer]);
+    merged = Statistics();
+    for( size_t i = 0; i< stats.size(); ++i) merged.merge(stats[i]);
+    m_total=merged.total; m_count=merged.count; m_sumsq=merged.sumsq;
+    m_min=merged.min; m_max=merged.max;
+}
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void SkyImage::fill_rows(const astro::SkyFunction& req, unsigned int layer, int first, int last, Statistics& stats)
+{
+    const Geometry& g(*m_geometry);
+    for( size_t k = first*m_naxis1; k< (unsigned int)(m_naxis1)*last; ++k){
+        double t = dnan;  // default value: nan
+        if( g.valid[k] ) {
+            t= req(g.dir(k));
+            stats.add(t);
         }
-        m_imageData[k+offset] = t;
+        m_imageData[offset(k, layer)] = t;
     }
-    return;
+}
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void SkyImage::fill(const LayerFunction& req)
+{
+    if( req.layers() != static_cast<size_t>(m_naxis3) ){
+        std::stringstream errmsg;
+        errmsg << "SkyImage: function has " << req.layers() 
+            << " layers, not compatible with axis3: " << m_naxis3 << std::endl;
+        throw std::invalid_argument(errmsg.str());
+    }
+    const healpix::Healpix* hp(req.pixelization());
+    if( hp!=0 ) geometry(*hp); else geometry();
+    std::vector<std::vector<Statistics> > stats(std::max(1u, m_nthreads), m_stats);
+    for( size_t i = 0; i< stats.size(); ++i) std::fill(stats[i].begin(), stats[i].end(), Statistics());
+    for_rows([&](int first, int last, size_t i){ fill_rows(req, first, last, stats[i]); });
+
+    std::fill(m_stats.begin(), m_stats.end(), Statistics());
+    for( size_t i = 0; i< stats.size(); ++i){
+        for( int layer = 0; layer< m_naxis3; ++layer) m_stats[layer].merge(stats[i][layer]);
+    }
+    // as if the layers had been filled in turn
+    const Statistics& last(m_stats.back());
+    m_total=last.total; m_count=last.count; m_sumsq=last.sumsq;
+    m_min=last.min; m_max=last.max;
+}
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void SkyImage::fill_rows(const LayerFunction& req, int first, int last, std::vector<Statistics>& stats)
+{
+    const Geometry& g(*m_geometry);
+    // with a pixelization, the indices cached in the geometry are passed instead of directions
+    bool byindex(req.pixelization()!=0);
+    size_t stride(layerStride());
+    std::vector<astro::SkyDir> dirs;
+    std::vector<long> pix;
+    std::vector<size_t> index;
+    std::vector<double> values;
+    for( int j = first; j< last; ++j){
+        dirs.clear(); pix.clear(); index.clear();
+        for( int i = 0; i< m_naxis1; ++i){
+            size_t k = i + m_naxis1*j;
+            if( g.valid[k] ) {
+                if( byindex ) pix.push_back(g.index[k]);
+                else dirs.push_back(g.dir(k));
+                index.push_back(k);
+            }else{
+                float* out(&m_imageData[offset(k, 0)]);
+                for( int layer = 0; layer< m_naxis3; ++layer) out[layer*stride] = dnan;
+            }
+        }
+        if( index.empty() ) continue;
+        if( byindex ) req(pix, values);
+        else req(dirs, values);
+        for( size_t p = 0; p< index.size(); ++p){
+            const double* t(&values[p*m_naxis3]);
+            float* out(&m_imageData[offset(index[p], 0)]);
+            for( int layer = 0; layer< m_naxis3; ++layer){
+                out[layer*stride] = t[layer];
+                stats[layer].add(t[layer]);
+            }
+        }
+    }
+}
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void SkyImage::for_rows(const std::function<void(int, int, size_t)>& fill)const
+{
+    size_t nthreads(std::max(1u, m_nthreads));
+    if( nthreads==1 ){
+        fill(0, m_naxis2, 0);
+        return;
+    }
+    // the projection sets itself up on first use: do that here, before it is shared
+    double x(1.0), y(1.0);
+    m_wcs->testpix2sph(x, y);
+
+    // each worker owns a contiguous range of rows, so writes no pixel that another does
+    std::vector<std::exception_ptr> errors(nthreads);
+    std::vector<std::thread> workers;
+    workers.reserve(nthreads);
+    for( size_t i = 0; i< nthreads; ++i){
+        int first(static_cast<int>(m_naxis2*i/nthreads)), last(static_cast<int>(m_naxis2*(i+1)/nthreads));
+        workers.push_back(std::thread([&fill, &errors, first, last, i](){
+            try{
+                fill(first, last, i);
+            }catch(...){
+                errors[i] = std::current_exception();
+            }
+        }));
+    }
+    for( size_t i = 0; i< nthreads; ++i) workers[i].join();
+    for( size_t i = 0; i< nthreads; ++i){
+        if( errors[i] ) std::rethrow_exception(errors[i]);
+    }
+}
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+const SkyImage::Geometry& SkyImage::geometry()const
+{
+    std::lock_guard<std::mutex> lock(m_geometryMutex);
+    return make_geometry();
+}
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SkyImage::Geometry& SkyImage::make_geometry()const
+{
+    if( m_geometry.get()!=0 ) return *m_geometry;
+
+    std::unique_ptr<Geometry> g(new Geometry);
+    size_t plane(m_naxis1*m_naxis2);
+    g->x.resize(plane, 0.);
+    g->y.resize(plane, 0.);
+    g->z.resize(plane, 0.);
+    g->nside = 0;
+    g->nested = false;
+    // the projection is the costly part, so is shared by the fill threads; the bitmap is
+    // made afterward, since threads cannot safely set neighboring bits
+    std::vector<char> inside(plane, 0);
+    for_rows([this, &g, &inside](int first, int last, size_t){
+        for( size_t k = first*m_naxis1; k< (unsigned int)(m_naxis1)*last; ++k){
+            // determine the bin center (pixel coords start at (1,1) in center of lower left
+            double 
+                x = static_cast<int>(k%m_naxis1)+1.0, 
+                y = static_cast<int>(k/m_naxis1)+1.0;
+            if( m_wcs->testpix2sph(x,y)==0) {
+                const CLHEP::Hep3Vector& v(astro::SkyDir(x,y, *m_wcs)());
+                g->x[k] = v.x(); g->y[k] = v.y(); g->z[k] = v.z();
+                inside[k] = 1;
+            }
+        }
+    });
+    g->valid.assign(inside.begin(), inside.end());
+    m_geometry = std::move(g);
+    return *m_geometry;
+}
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+const SkyImage::Geometry& SkyImage::geometry(const healpix::Healpix& hp)const
+{
+    std::lock_guard<std::mutex> lock(m_geometryMutex);
+    Geometry& g(make_geometry());
+    if( g.nside==hp.nside() && g.nested==hp.nested() ) return g;
+
+    g.index.assign(g.valid.size(), -1);
+    for( size_t k = 0; k< g.valid.size(); ++k){
+        if( g.valid[k] ) g.index[k] = healpix::Healpix::Pixel(g.dir(k), hp).index();
+    }
+    g.nside = hp.nside();
+    g.nested = hp.nested();
+    return g;
+}
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+const SkyImage::Statistics& SkyImage::statistics(unsigned int layer)const
+{
+    checkLayer(layer);
+    return m_stats[layer];
 }
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 void SkyImage::clear()
@@ -336,7 +519,13 @@ void SkyImage::clear()
 SkyImage::~SkyImage()
 {
     if( m_save) {
-        dynamic_cast<tip::TypedImage<float>*>(m_image)->set(m_imageData);
+        if( m_layout==PIXEL_MAJOR ){
+            std::vector<float> planes;
+            transpose(m_imageData, planes, false);
+            dynamic_cast<tip::TypedImage<float>*>(m_image)->set(planes);
+        }else{
+            dynamic_cast<tip::TypedImage<float>*>(m_image)->set(m_imageData);
+        }
     }
     delete m_image; 
     delete m_wcs;
@@ -349,6 +538,41 @@ double SkyImage::pixelValue(const astro::SkyDir& pos,unsigned  int layer)const
     return m_imageData[k];        
 }
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+unsigned int SkyImage::pixelIndex(const astro::SkyDir& pos)const
+{
+    // the index within a layer, whatever the layout
+    unsigned int k = plane_index(pos);
+    if( k >= (unsigned int)(m_naxis1*m_naxis2) ){
+        throw std::range_error("SkyImage::pixelIndex -- outside image");
+    }
+    return k;
+}
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+double SkyImage::layerValue(unsigned int index, unsigned int layer)const
+{
+    checkLayer(layer);
+    unsigned int plane(m_naxis1*m_naxis2);
+    if( index >= plane ){
+        throw std::out_of_range("SkyImage::layerValue -- pixel index outside the layer");
+    }
+    return m_imageData[offset(index, layer)];
+}
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void SkyImage::layerValues(unsigned int index, unsigned int first, unsigned int count, double* values)const
+{
+    if( count==0 ) return;
+    checkLayer(first+count-1);
+    unsigned int plane(m_naxis1*m_naxis2);
+    if( index >= plane ){
+        throw std::out_of_range("SkyImage::layerValues -- pixel index outside the layer");
+    }
+    const float* p(&m_imageData[offset(index, first)]);
+    size_t stride(layerStride());
+    for( unsigned int k = 0; k< count; ++k){
+        values[k] = p[k*stride];
+    }
+}
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 float &  SkyImage::operator[](const astro::SkyDir&  pixel)
 {
     unsigned int k = pixel_index(pixel);
@@ -377,32 +601,62 @@ void SkyImage::getNeighbors(const astro::SkyDir& pos, std::vector<double>&neighb
     unsigned int 
         i = static_cast<unsigned int>(p.first-0.5),
         j = static_cast<unsigned int>(p.second-0.5),
-        k = i+m_naxis1*(j + layer*m_naxis2);
-    if(i+1<(unsigned int)m_naxis1)neighbors.push_back(m_imageData[k+1]); 
-    if(i>0) neighbors.push_back(m_imageData[k-1]);
-    if(j+1<(unsigned int)m_naxis2)neighbors.push_back(m_imageData[k+m_naxis1]);
-    if(j>0)neighbors.push_back(m_imageData[k-m_naxis1]);
+        k = i+m_naxis1*j;
+    if(i+1<(unsigned int)m_naxis1)neighbors.push_back(m_imageData[offset(k+1, layer)]); 
+    if(i>0) neighbors.push_back(m_imageData[offset(k-1, layer)]);
+    if(j+1<(unsigned int)m_naxis2)neighbors.push_back(m_imageData[offset(k+m_naxis1, layer)]);
+    if(j>0)neighbors.push_back(m_imageData[offset(k-m_naxis1, layer)]);
 
 }
 
-// internal routine to convert a SkyDir to a pixel index
-unsigned int SkyImage::pixel_index(const astro::SkyDir& pos, int layer) const
+// internal routine to convert a SkyDir to the index of its pixel within a layer
+unsigned int SkyImage::plane_index(const astro::SkyDir& pos) const
 {
-    // if not specified, use the data member
-    if( layer<0 ) layer = m_layer;
-
     // project using wcslib interface, then adjust to be positive
     std::pair<double,double> p= pos.project(*m_wcs);
     if( p.first<0) p.first += m_naxis1;
     if(p.second<0) p.second += m_naxis2;
     unsigned int 
         i = static_cast<unsigned int>(p.first-0.5),
-        j = static_cast<unsigned int>(p.second-0.5),
-        k = i+m_naxis1*(j + layer*m_naxis2);
+        j = static_cast<unsigned int>(p.second-0.5);
+    return i+m_naxis1*j;
+}
+
+// internal routine to convert a SkyDir to a pixel index
+unsigned int SkyImage::pixel_index(const astro::SkyDir& pos, int layer) const
+{
+    // if not specified, use the data member
+    if( layer<0 ) layer = m_layer;
+
+    unsigned int k = offset(plane_index(pos), layer);
      if( k > m_pixelCount+1 ) {
         throw std::range_error("SkyImage::pixel_index -- outside image hyper cube");
     }
     return k;
 }
-
-
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void SkyImage::setLayout(Layout layout)
+{
+    if( layout==m_layout ) return;
+    std::vector<float> data;
+    transpose(m_imageData, data, layout==PIXEL_MAJOR);
+    m_imageData.swap(data);
+    m_layout = layout;
+}
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void SkyImage::transpose(const std::vector<float>& data, std::vector<float>& out, bool to_pixel_major)const
+{
+    size_t plane(m_naxis1*m_naxis2), nlayers(m_naxis3);
+    out.resize(data.size());
+    // in blocks of pixels, so that the writes, or reads, of the pixel-major side stay in the cache
+    const size_t block(256);
+    for( size_t first = 0; first< plane; first+=block){
+        size_t last(std::min(plane, first+block));
+        for( size_t layer = 0; layer< nlayers; ++layer){
+            for( size_t k = first; k< last; ++k){
+                if( to_pixel_major ) out[k*nlayers+layer] = data[k+layer*plane];
+                else out[k+layer*plane] = data[k*nlayers+layer];
+            }
+        }
+    }
+}
@@ -0,0 +1,112 @@
+/** @file WorkerPool.h
+    @brief define WorkerPool, the fill threads that Exposure::load keeps for the whole load
+
+    $Header$
+*/
+#ifndef MAP_TOOLS_WORKERPOOL_H
+#define MAP_TOOLS_WORKERPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <cstddef>
+
+namespace map_tools {
+
+/** @class WorkerPool
+    @brief a fixed set of threads that run one job at a time, each with its own index
+
+    The threads are started once, and wait between jobs, so a job for every block of rows
+    costs a wake-up rather than the creation of a thread. The calling thread takes the last
+    index of each job itself.
+*/
+class WorkerPool {
+public:
+    //! @param nthreads number of indices of a job, including the calling thread
+    WorkerPool(size_t nthreads)
+        : m_size(nthreads>0? nthreads : 1), m_job(0), m_generation(0), m_pending(0), m_stop(false)
+        , m_errors(m_size)
+    {
+        for( size_t i=0; i+1< m_size; ++i) m_threads.push_back(std::thread([this, i](){ work(i); }));
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_start.notify_all();
+        for( size_t i=0; i< m_threads.size(); ++i) m_threads[i].join();
+    }
+
+    size_t size()const{return m_size;}
+
+    /** @brief call job(i) for i = 0 to size()-1, at once, and wait for all of them
+        An exception thrown by any of them is rethrown here, the one with the lowest index first.
+    */
+    void run(const std::function<void(size_t)>& job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job = &job;
+            m_pending = m_threads.size();
+            for( size_t i=0; i< m_size; ++i) m_errors[i] = std::exception_ptr();
+            ++m_generation;
+        }
+        m_start.notify_all();
+        try{
+            job(m_size-1);
+        }catch(...){
+            m_errors[m_size-1] = std::current_exception();
+        }
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_done.wait(lock, [this](){ return m_pending==0; });
+            m_job = 0;
+        }
+        for( size_t i=0; i< m_size; ++i){
+            if( m_errors[i] ) std::rethrow_exception(m_errors[i]);
+        }
+    }
+
+private:
+    WorkerPool(const WorkerPool&);
+    WorkerPool& operator=(const WorkerPool&);
+
+    void work(size_t i)
+    {
+        size_t seen(0);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for(;;){
+            m_start.wait(lock, [this, seen](){ return m_stop || m_generation!=seen; });
+            if( m_stop ) return;
+            seen = m_generation;
+            const std::function<void(size_t)>& job(*m_job);
+            lock.unlock();
+            try{
+                job(i);
+            }catch(...){
+                m_errors[i] = std::current_exception();
+            }
+            lock.lock();
+            if( --m_pending==0 ) m_done.notify_one();
+        }
+    }
+
+    size_t m_size;
+    const std::function<void(size_t)>* m_job;
+    size_t m_generation; ///< count of jobs, so that a worker runs each one once
+    size_t m_pending;    ///< workers still running the current job
+    bool m_stop;
+    std::vector<std::exception_ptr> m_errors; ///< of the current job, by index
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_start, m_done;
+};
+
+} // namespace map_tools
+#endif
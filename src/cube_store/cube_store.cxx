@@ -0,0 +1,114 @@
+/** @file cube_store.cxx
+@brief build the cube_store application: update or query a store of exposure cubes at a fixed cadence
+
+$Header$
+*/
+
+#include "map_tools/CubeStore.h"
+
+#include "st_app/StApp.h"
+#include "st_app/StAppFactory.h"
+#include "st_app/AppParGroup.h"
+
+#include "st_stream/StreamFormatter.h"
+#include "st_stream/st_stream.h"
+#include "tip/IFileSvc.h"
+#include "tip/Table.h"
+
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+using namespace map_tools;
+
+
+class CubeStoreApp : public st_app::StApp {
+public:
+    CubeStoreApp()
+        : st_app::StApp()
+        , m_pars(st_app::StApp::getParGroup("cube_store"))
+        , m_f("CubeStoreApp", "", 2)
+    {}
+    ~CubeStoreApp() throw() {} // required by StApp with gcc
+
+    void run()
+    {
+        m_f.setMethod("run()");
+        prompt();
+
+        std::string action(m_pars["action"].Value()), 
+            store(m_pars["store"].Value()),
+            scfile(m_pars["scfile"].Value()),
+            table(m_pars["table"].Value());
+        double tstart(m_pars["tstart"]), tstop(m_pars["tstop"]);
+
+        // note that the phi binning option is turned on by setting the static parameter
+        double phibins(m_pars["phibins"]);
+        if( phibins>0) healpix::CosineBinner::setPhiBins(phibins); 
+
+        CubeStore cubes(store);
+        std::unique_ptr<const tip::Table> scData;
+        if( scfile!="NONE" && !scfile.empty() ){
+            scData.reset(tip::IFileSvc::instance().readTable(scfile, table));
+        }
+
+        if( action=="update" ){
+            if( scData.get()==0 ) throw std::invalid_argument("cube_store: update needs scfile");
+            double cadence(m_pars["cadence"]), pixelsize(m_pars["pixelsize"]), 
+                binsize(m_pars["binsize"]), zmin(m_pars["zmin"]);
+            size_t before(cubes.size());
+            cubes.update(scData.get(), cadence, tstart, Exposure::GTIvector(),
+                pixelsize, binsize, zmin);
+            m_f.info() << "added " << cubes.size()-before << " checkpoints to " << store 
+                << ", which now ends at " << cubes.time(cubes.size()-1) << std::endl;
+
+        }else if( action=="query" ){
+            std::string outfile(m_pars["outfile"].Value()),
+                outtable(m_pars["outtable"].Value()),
+                outtable2(m_pars["outtable2"].Value());
+            std::unique_ptr<Exposure> ex, ex2;
+            cubes.query(tstart, tstop, scData.get(), ex, ex2);
+            m_f.info() << "writing the exposure for [" << tstart << ", " << tstop << "] to " 
+                << outfile << std::endl;
+            ex->write(outfile, outtable);
+            ex2->write(outfile, outtable2, false);
+            ex->writeCoverage(outfile);
+        }else{
+            throw std::invalid_argument("cube_store: action must be update or query, not "+action);
+        }
+    }
+
+    void prompt() {
+        m_pars.Prompt("action");
+        m_pars.Prompt("store");
+        m_pars.Prompt("scfile");
+        m_pars.Prompt("tstart");
+        m_pars.Prompt("tstop");
+        m_pars.Prompt("outfile");
+        m_pars.Prompt("chatter");
+        m_pars.Prompt("clobber");
+        m_pars.Prompt("debug");
+        m_pars.Prompt("gui");
+        m_pars.Save();
+    }
+
+private:
+    hoops::ParPromptGroup m_pars;
+    st_stream::StreamFormatter m_f;
+};
+// Factory which can create an instance of the class above.
+st_app::StAppFactory<CubeStoreApp> g_factory("cube_store");
+
+/** @page cube_store_guide cube_store users guide
+
+Keep a store of cumulative exposure cubes, at a fixed cadence, and extract the exposure for any time interval.
+
+- action=update: add checkpoints, every cadence seconds from tstart, up to the end of the
+  spacecraft file. Each holds the exposure since tstart, as a cube and as sums in double.
+  A new store takes its binning from pixelsize, binsize, zmin and phibins.
+- action=query: write the exposure for [tstart, tstop] to outfile, as exposure_cube does. It is
+  the difference of two checkpoints, however long the interval; the spacecraft file is needed
+  for the parts of the interval between checkpoints.
+
+@verbinclude cube_store.par
+
+*/
@@ -7,6 +7,7 @@ $Header: /nfs/slac/g/glast/ground/cvs/map_tools/src/exposure_cube/exposure_cube.
 
 #include "hoops/hoops_prompt_group.h"
 #include "map_tools/Exposure.h"
+#include "map_tools/ExposureSeries.h"
 #include "healpix/HealpixArrayIO.h"
 
 #include "astro/SkyDir.h"
@@ -21,8 +22,11 @@ $Header: /nfs/slac/g/glast/ground/cvs/map_tools/src/exposure_cube/exposure_cube.
 #include "st_stream/st_stream.h"
 #include "tip/IFileSvc.h"
 #include "tip/Table.h"
+#include "facilities/Util.h"
 
 #include <iostream>
+#include <fstream>
+#include <memory>
 #include <stdexcept>
 using namespace map_tools;
 using healpix::HealpixArrayIO;
@@ -93,6 +97,8 @@ public:
         // create the differential exposure object
 	double pixelsize(m_pars["pixelsize"]), binsize(m_pars["binsize"]);
         double phibins(m_pars["phibins"]);
+        int nthreads(m_pars["nthreads"]), batchsize(m_pars["batchsize"]), queuedepth(m_pars["queuedepth"]);
+        double aggregation(m_pars["aggregation"]);
 		
         double tstart(m_pars["tstart"]),
                tstop(m_pars["tstop"]),
@@ -101,19 +107,55 @@ public:
         // note that the phi binning option is turned on by setting the static parameter
         if( phibins>0) healpix::CosineBinner::setPhiBins(phibins); 
 
-        Exposure ex( pixelsize, binsize, zmin);
-        Exposure ex2(pixelsize, binsize, zmin, true); // second map with weighted bins
-        Exposure::GTIvector gti; 
-
-        gti.push_back(std::make_pair(tstart,tstop));
         std::string infile(m_pars["infile"].Value()),
             outfile(m_pars["outfile"].Value()),
             table(m_pars["table"].Value()),
             outtable(m_pars["outtable"].Value()),
             outtable2(m_pars["outtable2"].Value());
+        bool append(m_pars["append"]);
+        std::string tbinfile(m_pars["tbinfile"].Value());
+        if( tbinfile!="NONE" && !tbinfile.empty() ){
+            // the series fills each bin directly, so these have no effect on it
+            if( append ) throw std::invalid_argument("exposure_cube: append cannot be used with tbinfile");
+            if( aggregation>0 ) throw std::invalid_argument("exposure_cube: aggregation cannot be used with tbinfile");
+            if( queuedepth>0 ) throw std::invalid_argument("exposure_cube: queuedepth cannot be used with tbinfile");
+            runSeries(tbinfile, infile, outfile, table, outtable, outtable2, 
+                pixelsize, binsize, zmin, nthreads, batchsize, std::make_pair(tstart, tstop));
+            return;
+        }
+
+        std::unique_ptr<Exposure> pex, pex2;
+        if( append ){
+            // add to the cubes in outfile: only rows outside the times they include are used
+            m_f.info() << "Appending to the exposure cube " << outfile << std::endl;
+            pex.reset(new Exposure(outfile, outtable));
+            pex2.reset(new Exposure(outfile, outtable2));
+            pex->checkAppend(binsize, zmin);
+            m_f.info() << "	already includes " << pex->coverage().size() << " time intervals" << std::endl;
+        }else{
+            pex.reset(new Exposure( pixelsize, binsize, zmin));
+            pex2.reset(new Exposure(pixelsize, binsize, zmin, true)); // second map with weighted bins
+        }
+        Exposure& ex(*pex);
+        Exposure& ex2(*pex2);
+        ex.setThreads(nthreads);
+        ex2.setThreads(nthreads);
+        ex.setBatchSize(batchsize);
+        ex2.setBatchSize(batchsize);
+        ex.setAggregation(aggregation);
+        ex.setQueueDepth(queuedepth);
+        Exposure::GTIvector gti; 
+
+        gti.push_back(std::make_pair(tstart,tstop));
 
         m_f.info() << "Creating an exposure object from a pointing history file ..." << infile << std::endl;
         m_f.info() << "\ttstart: " << tstart << "\n\t tstop: "<< tstop << std::endl;
+        if( nthreads>1 ){
+            m_f.info() << "\tfilling with " << nthreads << " threads" << std::endl;
+        }
+        if( aggregation>0 ){
+            m_f.info() << "\tcombining rows on a " << aggregation << " deg grid in orientation" << std::endl;
+        }
         if( zmin>-1.){
             m_f.info() << "\t  zmin: "<< zmin << ", cut above horizon " << std::endl;
         }
@@ -128,22 +170,56 @@ public:
             loadExposureWithGPS(ex, infile, gti);
         }else{
             tip::Table * scData = tip::IFileSvc::instance().editTable(infile, table);
-            ex.load(scData, gti);
-            ex2.load(scData, gti);
+            // one pass fills both the exposure and the weighted exposure
+            ex.load(scData, ex2, gti);
         }
 
         // create the fits output file from the Exposure file
         m_f.info() 
             << "writing out the differential exposure file to "
             << outfile << ": added " << ex.total() << " seconds" << std::endl;
+        if( aggregation>0 && ex.aggregatedCells()>0 ){
+            m_f.info() << " combined " << ex.aggregatedRows() << " rows into " << ex.aggregatedCells() 
+                << " cells, compression ratio " << double(ex.aggregatedRows())/ex.aggregatedCells() << std::endl;
+        }
         if( zmin>-1){
             m_f.info() << " lost " << ex.lost() << " seconds from zcut" << std::endl;
         }
-       HealpixArrayIO::instance().write(ex.data(), outfile, outtable);
-       HealpixArrayIO::instance().write(ex2.data(), outfile, outtable2, false);
+       ex.write(outfile, outtable);
+       ex2.write(outfile, outtable2, false);
+       ex.writeCoverage(outfile);
 
  
     }
+    //! fill one pair of cubes per time bin, with the bin edges read from a text file
+    void runSeries(const std::string& tbinfile, const std::string& infile, const std::string& outfile,
+        const std::string& table, const std::string& outtable, const std::string& outtable2,
+        double pixelsize, double binsize, double zmin, int nthreads, int batchsize,
+        const std::pair<double,double>& range)
+    {
+        std::vector<double> edges;
+        std::string name(tbinfile);
+        facilities::Util::expandEnvVar(&name);
+        std::ifstream in(name.c_str());
+        if( !in ) throw std::invalid_argument("exposure_cube: could not open time bin file "+name);
+        double edge;
+        while( in >> edge ) edges.push_back(edge);
+
+        int maxcubes(m_pars["maxcubes"]);
+        ExposureSeries series(edges, outfile, pixelsize, binsize, zmin, maxcubes);
+        series.setTableNames(outtable, outtable2);
+        series.setThreads(nthreads);
+        series.setBatchSize(batchsize);
+        m_f.info() << "Filling " << series.size() << " time bins from " << infile 
+            << ", keeping at most " << maxcubes << " finished bins in memory" << std::endl;
+
+        tip::Table * scData = tip::IFileSvc::instance().editTable(infile, table);
+        series.load(scData, Exposure::GTIvector(1, range));
+        series.finish();
+        m_f.info() << "wrote " << series.written() << " pairs of cubes to " << outfile 
+            << ": added " << series.total() << " seconds" << std::endl;
+    }
+
     void prompt() {
         m_pars.Prompt("infile");
         m_pars.Prompt("outfile");
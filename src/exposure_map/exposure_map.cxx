@@ -1,4 +1,3 @@
-
 /** @file exposure_map.cxx
 @brief Classes specific to the exposure_map application
 
@@ -11,6 +10,12 @@ $Header: /nfs/slac/g/glast/ground/cvs/map_tools/src/exposure_map/exposure_map.cx
 
 #include "map_tools/SkyImage.h"
 #include "map_tools/Exposure.h"
+#include "map_tools/BinnerTable.h"
+#include "map_tools/LayerExposure.h"
+#include "map_tools/AeffCache.h"
+#include "map_tools/ResultStore.h"
+#include "map_tools/ContentHash.h"
+#include "healpix/Healpix.h"
 
 #include "astro/SkyDir.h"
 
@@ -40,6 +45,10 @@ $Header: /nfs/slac/g/glast/ground/cvs/map_tools/src/exposure_map/exposure_map.cx
 
 
 #include <stdexcept>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#include <errno.h> // to test result of std::remove()
 
 namespace {
    void writeEnergies(const std::string & filename,
@@ -63,6 +72,75 @@ namespace {
 
       delete table;
    }
+   /** @brief write the exposure for each layer, at the pixels of a HEALPix map, as the
+       columns ENERGY1, ENERGY2,... of a SKYMAP table
+       @param exposure the function of the layers, with the pixelization of the cube
+       @param hp the pixelization of the map. Each map pixel takes the cube pixel that contains
+       its center, so no projection is involved.
+       @param galactic true if hp is in galactic coordinates
+       @return the statistics of each layer
+   */
+   std::vector<map_tools::SkyImage::Statistics> writeHealpix(const std::string& filename, bool clobber,
+                      const map_tools::LayerExposure& exposure, const healpix::Healpix& hp, bool galactic)
+   {
+      using healpix::Healpix;
+      if( clobber ){
+          int rc = std::remove(filename.c_str());
+          if( rc==-1 && errno ==EACCES ) throw std::runtime_error(
+              std::string("exposure_map: cannot remove file "+filename));
+      }
+      const Healpix& cube(*exposure.pixelization());
+      size_t npix(hp.npix()), layers(exposure.layers());
+      std::vector<std::vector<float> > maps(layers, std::vector<float>(npix));
+      std::vector<map_tools::SkyImage::Statistics> stats(layers);
+
+      static const size_t block(4096);
+      std::vector<long> pix;
+      std::vector<double> values;
+      for( size_t first=0; first<npix; first+=block){
+          size_t last(std::min(npix, first+block));
+          pix.clear();
+          for( size_t p=first; p<last; ++p){
+              astro::SkyDir dir = Healpix::Pixel(p, hp);
+              pix.push_back(Healpix::Pixel(dir, cube).index());
+          }
+          exposure(pix, values);
+          for( size_t p=first; p<last; ++p){
+              const double* t(&values[(p-first)*layers]);
+              for( size_t k=0; k<layers; ++k){
+                  maps[k][p] = t[k];
+                  stats[k].add(t[k]);
+              }
+          }
+      }
+
+      std::string ext("SKYMAP");
+      tip::IFileSvc & fileSvc(tip::IFileSvc::instance());
+      fileSvc.appendTable(filename, ext);
+      std::unique_ptr<tip::Table> table(fileSvc.editTable(filename, ext));
+      std::vector<std::string> names;
+      for( size_t k=0; k<layers; ++k){
+          std::stringstream name; name << "ENERGY" << (k+1);
+          names.push_back(name.str());
+          table->appendField(names.back(), "E");
+      }
+      table->setNumRecords(npix);
+      tip::Table::Iterator row = table->begin();
+      tip::Table::Record & record = *row;
+      for( size_t p=0; p<npix; ++p, ++row){
+          for( size_t k=0; k<layers; ++k) record[names[k]].set(maps[k][p]);
+      }
+      tip::Header& header(table->getHeader());
+      header["PIXTYPE"].set(std::string("HEALPIX"));
+      header["ORDERING"].set(std::string(hp.nested()? "NESTED" : "RING"));
+      header["NSIDE"].set(static_cast<long>(hp.nside()));
+      header["FIRSTPIX"].set(0L);
+      header["LASTPIX"].set(static_cast<long>(npix-1));
+      header["INDXSCHM"].set(std::string("IMPLICIT"));
+      header["COORDSYS"].set(std::string(galactic? "GAL" : "CEL"));
+      return stats;
+   }
+
    bool use_phi_dependence(false); // set below   
   double phioffset(15.);  // central phi value, will be used if step is 45.
 }
@@ -125,29 +203,6 @@ public:
     double m_energy;
     double m_cutoff;
 };
-//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-/** @class RequestExposure 
-@brief function class requests a point from the exposure
-*/
-template< class F>
-class RequestExposure : public astro::SkyFunction
-{
-public:
-    RequestExposure(const Exposure& exp, const F& aeff, double norm=1.0)
-        : m_exp(exp)
-        , m_aeff(aeff)
-        , m_norm(norm)
-    {}
-    double operator()(const astro::SkyDir& s)const{
-        if( use_phi_dependence)  return m_norm*m_exp.integral(s, m_aeff);
-        return m_norm*m_exp(s,m_aeff);
-    }
-private:
-    const Exposure& m_exp;
-    const F& m_aeff;
-    double m_norm;
-};
-
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 /** @class ExposureMapApp
 @brief the exposure_map application class
@@ -170,6 +225,46 @@ public:
     */
 
 
+  /** @return the individual response functions for a name, which may be that of a group of them,
+      or empty for SIMPLE
+  */
+  std::vector<std::string> irfList(const std::string& rspfunc)
+    {
+        using namespace irfInterface;
+        // set up irf stuff, and translate the IRF name        
+
+        irfLoader::Loader::go();
+        if( rspfunc=="SIMPLE") return std::vector<std::string>();
+
+        std::map<std::string, std::vector<std::string> > idMap = irfLoader::Loader::respIds();
+        std::vector<std::string> irf_list = idMap[rspfunc];
+        if( irf_list.empty()) {
+
+            std::vector<std::string> irfnames;
+            IrfsFactory::instance()->getIrfsNames(irfnames);
+            if( std::find(irfnames.begin(), irfnames.end(), rspfunc) == irfnames.end() ){
+            std::cerr << "\nResponse function \""<< rspfunc<< "\" Not recognized: Valid list of individual irfs: \n\t";
+            std::copy(irfnames.begin(), irfnames.end(), 
+                std::ostream_iterator<std::string>(std::cerr, "\n\t "));
+            std::cerr <<std::endl;
+
+            std::cerr<< "Names for groups of irfs:\n \t";
+            for( std::map<std::string, std::vector<std::string> >::const_iterator it = irfLoader::Loader::respIds().begin();
+                it != irfLoader::Loader::respIds().end() ; ++it)
+            {
+                std::cerr << "\n\t" << it->first << "\t ";
+                std::copy(it->second.begin(), it->second.end(), std::ostream_iterator<std::string>(std::cerr, " "));
+            }
+            std::cerr << std::endl;
+
+            throw std::invalid_argument(
+                std::string("Response function not recognized: "+rspfunc));
+            }
+            irf_list.push_back(rspfunc);
+        }
+        return irf_list;
+    }
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   irfInterface::IAeff* findAeff(std::string rspfunc)
     {
         using namespace irfInterface;
@@ -226,42 +321,13 @@ public:
         };
 
 
-        // set up irf stuff, and translate the IRF name        
-
-        irfLoader::Loader::go();
- 
         m_f.info() << "Using Aeff(s) " ;
 
         if( rspfunc=="SIMPLE") {
             m_f.info() << "Simple linear form " << std::endl;
             return 0;
         }
-        std::map<std::string, std::vector<std::string> > idMap = irfLoader::Loader::respIds();
-        std::vector<std::string> irf_list = idMap[rspfunc];
-        if( irf_list.empty()) {
-
-            std::vector<std::string> irfnames;
-            IrfsFactory::instance()->getIrfsNames(irfnames);
-            if( std::find(irfnames.begin(), irfnames.end(), rspfunc) == irfnames.end() ){
-            std::cerr << "\nResponse function \""<< rspfunc<< "\" Not recognized: Valid list of individual irfs: \n\t";
-            std::copy(irfnames.begin(), irfnames.end(), 
-                std::ostream_iterator<std::string>(std::cerr, "\n\t "));
-            std::cerr <<std::endl;
-
-            std::cerr<< "Names for groups of irfs:\n \t";
-            for( std::map<std::string, std::vector<std::string> >::const_iterator it = irfLoader::Loader::respIds().begin();
-                it != irfLoader::Loader::respIds().end() ; ++it)
-            {
-                std::cerr << "\n\t" << it->first << "\t ";
-                std::copy(it->second.begin(), it->second.end(), std::ostream_iterator<std::string>(std::cerr, " "));
-            }
-            std::cerr << std::endl;
-
-            throw std::invalid_argument(
-                std::string("Response function not recognized: "+rspfunc));
-            }
-            irf_list.push_back(rspfunc);
-        }
+        std::vector<std::string> irf_list(irfList(rspfunc));
 
         std::stringstream buf;
         m_f.info() << "\nCombining exposure from the response function(s), specified by \""<< rspfunc<< "\": \n\t";
@@ -278,7 +344,55 @@ public:
         m_f.setMethod("run()");
 
         prompt();
-				
+
+        //Read in theta cuts from the event file
+        std::string event_file = m_pars["evfile"];
+        //Initialize the cut to have the whole range
+        dataSubselector::RangeCut thetaCut("THETA", "deg", ":90", 0);
+        if (event_file != "" && event_file !="NONE" ) {
+            std::string evtable = m_pars["evtable"];
+            std::vector<std::string> eventFiles;
+            st_facilities::Util::resolve_fits_files(event_file, eventFiles);
+            //Read the cuts, skipping time and event cuts
+            dataSubselector::Cuts * cuts = new dataSubselector::Cuts(eventFiles, evtable, false, true, true);
+            //Loop over the cuts, finding cuts in Theta
+            for (unsigned int i = 0; i < cuts->size(); ++i) {
+                dataSubselector::CutBase & cut = const_cast<dataSubselector::CutBase &>(cuts->operator[](i));
+                if (cut.type() == "range") {
+                    dataSubselector::RangeCut & rangeCut = dynamic_cast<dataSubselector::RangeCut &>(cut);
+                    if (rangeCut.colname() == "THETA") {
+                        if (rangeCut.maxVal() < thetaCut.maxVal()) {
+                            thetaCut = rangeCut;
+                        }
+                    }
+                }
+            }
+            delete cuts;
+        }
+        double ctcutoff = cos(thetaCut.maxVal()*M_PI/180);
+
+        m_f.info() << "cos theta cutoff used: " << (std::abs(ctcutoff)< 1e-6? 0: ctcutoff) << std::endl;
+
+
+        std::vector<double> energy(SkyImage::energies(m_pars));
+
+        // if the same inputs have been seen before, provide the saved output
+        std::string storedir = m_pars["resultstore"];
+        std::unique_ptr<ResultStore> store;
+        std::string resultkey;
+        if( storedir!="NONE" && !storedir.empty() ){
+            double maxsize = m_pars["resultmaxsize"];
+            bool link = m_pars["resultlink"];
+            store.reset(new ResultStore(storedir, maxsize*1e6, link));
+            resultkey = resultKey(ctcutoff, energy);
+            // without clobber, an existing outfile is not replaced: the map is made as usual
+            if( store->fetch(resultkey, m_pars["outfile"], m_pars["clobber"]) ){
+                m_f.info() << "Output with the same inputs found in " << store->path(resultkey) 
+                    << ", provided as " << m_pars["outfile"].Value() << std::endl;
+                return;
+            }
+        }
+
         // create the exposure, read it in from the FITS input file
         m_f.info() << "Creating an Exposure object from file " << m_pars["infile"].Value() << std::endl;
 
@@ -307,59 +421,117 @@ public:
             use_phi_dependence = true;
           }
 
-        irfInterface::IAeff* aeff = findAeff(m_pars["irfs"]);
-
-        //Read in theta cuts from the event file
-        std::string event_file = m_pars["evfile"];
-        //Initialize the cut to have the whole range
-        dataSubselector::RangeCut thetaCut("THETA", "deg", ":90", 0);
-        if (event_file != "" && event_file !="NONE" ) {
-            std::string evtable = m_pars["evtable"];
-            std::vector<std::string> eventFiles;
-            st_facilities::Util::resolve_fits_files(event_file, eventFiles);
-            //Read the cuts, skipping time and event cuts
-            dataSubselector::Cuts * cuts = new dataSubselector::Cuts(eventFiles, evtable, false, true, true);
-            //Loop over the cuts, finding cuts in Theta
-            for (unsigned int i = 0; i < cuts->size(); ++i) {
-                dataSubselector::CutBase & cut = const_cast<dataSubselector::CutBase &>(cuts->operator[](i));
-                if (cut.type() == "range") {
-                    dataSubselector::RangeCut & rangeCut = dynamic_cast<dataSubselector::RangeCut &>(cut);
-                    if (rangeCut.colname() == "THETA") {
-                        if (rangeCut.maxVal() < thetaCut.maxVal()) {
-                            thetaCut = rangeCut;
-                        }
-                    }
-                }
+        std::string irfs = m_pars["irfs"];
+
+        // the effective area depends only on the bin, not the pixel: evaluate it once per bin,
+        // or take the tables saved by an earlier run with the same inputs
+        AeffCache::Entry aeffTables;
+        std::string cachedir = m_pars["aeffcache"];
+        std::unique_ptr<AeffCache> cache;
+        std::string key;
+        if( cachedir!="NONE" && !cachedir.empty() ){
+            cache.reset(new AeffCache(cachedir));
+            // found by the name alone: the response functions are loaded only if there are no tables
+            key = AeffCache::key(irfs, AeffCache::irfFiles(std::vector<std::string>(1, irfs)), 
+                energy, ctcutoff, use_phi_dependence);
+        }
+        if( cache.get()!=0 && cache->find(key, aeffTables) ){
+            m_f.info() << "Using effective area tables from " << cache->path(key) << std::endl;
+            use_phi_dependence = aeffTables.use_phi;
+        }else{
+            irfInterface::IAeff* aeff = findAeff(irfs);
+            for ( std::vector<double>::size_type layer = 0; layer != energy.size(); ++layer){
+                IrfAeff a(IrfAeff(aeff, energy[layer],ctcutoff));
+                aeffTables.etendue.push_back(a.etendue());
+                aeffTables.tables.push_back(BinnerTable(a, ex.data()[0], use_phi_dependence));
+            }
+            aeffTables.use_phi = use_phi_dependence;
+            if( cache.get()!=0 ){
+                cache->store(key, aeffTables);
+                m_f.info() << "Saved effective area tables to " << cache->path(key) << std::endl;
+            }
+        }
+        const std::vector<double>& etendue(aeffTables.etendue);
+        LayerExposure layers(ex, aeffTables.tables);
+
+        std::vector<SkyImage::Statistics> stats;
+        int hpxnside = m_pars["hpxnside"];
+        if( hpxnside>0 ){
+            // a HEALPix map for each layer, taken directly from the cube pixels
+            std::string ordering = m_pars["hpxorder"];
+            for ( std::string::iterator itor = ordering.begin(); itor != ordering.end(); ++itor) *itor = std::toupper(*itor);
+            std::string coord_sys = m_pars["coordsys"];
+            for ( std::string::iterator itor = coord_sys.begin(); itor != coord_sys.end(); ++itor) *itor = std::toupper(*itor);
+            healpix::Healpix hp(hpxnside, 
+                ordering=="NESTED"? healpix::Healpix::NESTED : healpix::Healpix::RING,
+                coord_sys=="GAL"? astro::SkyDir::GALACTIC : astro::SkyDir::EQUATORIAL);
+            std::clog << "Creating HEALPix maps, nside " << hpxnside << ", " << ordering 
+                << " ordering, will write to file " << m_pars["outfile"].Value() << std::endl;
+            stats = writeHealpix(m_pars["outfile"], m_pars["clobber"], layers, hp, coord_sys=="GAL");
+        }else{
+            // create the image object, fill it from the exposure, write out
+            std::clog << "Creating an Image, will write to file " << m_pars["outfile"].Value() << std::endl;
+            SkyImage image(m_pars); 
+            int nthreads = m_pars["nthreads"];
+            image.setThreads(nthreads);
+            // all the layers are filled in one sweep over the image
+            image.fill(layers);
+            for ( std::vector<double>::size_type layer = 0; layer != energy.size(); ++layer){
+                stats.push_back(image.statistics(layer));
             }
-            delete cuts;
         }
-        double ctcutoff = cos(thetaCut.maxVal()*M_PI/180);
-
-        m_f.info() << "cos theta cutoff used: " << (std::abs(ctcutoff)< 1e-6? 0: ctcutoff) << std::endl;
-
 
-        // create the image object, fill it from the exposure, write out
-        std::clog << "Creating an Image, will write to file " << m_pars["outfile"].Value() << std::endl;
-        SkyImage image(m_pars); 
-        std::vector<double> energy;
-        image.getEnergies(energy);
         std::clog << "Layer  energy    etendue  miniumum    mean        maximum" << std::endl;
                   //    0    208.11      4032   5.63e+009   6.89e+009   7.93e+009
         for ( std::vector<double>::size_type layer = 0; layer != energy.size(); ++layer){
-            
-            IrfAeff a(IrfAeff(aeff, energy[layer],ctcutoff));
+            const SkyImage::Statistics& s(stats[layer]);
             std::clog << std::setprecision(5) 
                       << std::setw(3) << layer << std::setw(10)<< int(energy[layer]+0.5) 
-                      << std::setw(10)<< int(a.etendue()+0.5)  ;
-
-            RequestExposure<IrfAeff> req(ex, a, 1.); 
-            image.fill(req, layer);
+                      << std::setw(10)<< int(etendue[layer]+0.5)  ;
             std::clog << std::setprecision(3)
-                    << std::setw(12)<< image.minimum() 
-                    << std::setw(12)<< (image.count()>0? image.total()/image.count() : 0)
-                    << std::setw(12)<<  image.maximum() << std::endl;
+                    << std::setw(12)<< s.min 
+                    << std::setw(12)<< (s.count>0? s.total/s.count : 0)
+                    << std::setw(12)<<  s.max << std::endl;
         }
         ::writeEnergies(m_pars["outfile"], energy);
+
+        if( store.get()!=0 ){
+            store->save(resultkey, m_pars["outfile"]);
+            m_f.info() << "Saved the output as " << store->path(resultkey) << std::endl;
+        }
+    }
+
+    /** @return a hash of everything that determines the output: the contents of the cube and
+        count map files, the response functions and the files they are read from, and the parameters for the theta cut,
+        phi, geometry and energies
+    */
+    std::string resultKey(double ctcutoff, const std::vector<double>& energy)
+    {
+        ContentHash hash;
+        hash.add("exposure_map");
+        std::string in_file = m_pars["infile"];
+        hash.addFile(in_file);
+        const char* caldb(std::getenv("CALDB"));
+        hash.add(std::string(caldb!=0? caldb : ""));
+        // the files, so that a CALDB updated in place gives a new key
+        std::string irfs = m_pars["irfs"];
+        std::vector<std::string> files(AeffCache::irfFiles(std::vector<std::string>(1, irfs)));
+        for( std::vector<std::string>::const_iterator it=files.begin(); it!=files.end(); ++it) hash.addFileStat(*it);
+        hash.add(ctcutoff);
+        for( std::vector<double>::const_iterator it=energy.begin(); it!=energy.end(); ++it) hash.add(*it);
+
+        std::string uc_cm_file = m_pars["cmfile"];
+        for ( std::string::iterator itor = uc_cm_file.begin(); itor != uc_cm_file.end(); ++itor) *itor = std::toupper(*itor);
+        if( uc_cm_file!="NONE" ){
+            std::string cm_file = m_pars["cmfile"];
+            hash.addFile(cm_file);
+        }
+        static const char* names[] = {"table", "irfs", "ignorephi", "cmfile", "nxpix", "nypix", "pixscale", 
+            "coordsys", "xref", "yref", "axisrot", "proj", "bincalc", "hpxnside", "hpxorder"};
+        for( size_t i=0; i< sizeof(names)/sizeof(names[0]); ++i){
+            hash.add(names[i]).add(m_pars[names[i]].Value());
+        }
+        return hash.str();
     }
 
     void prompt() {
@@ -495,6 +667,31 @@ General Parameters
     
   (table = "Exposure")  
     Exposure cube extension. 
+
+  (aeffcache = "NONE") [string]
+    Directory in which to save the effective area tabulated for the cube bins, keyed by the
+    response functions, energies, theta cut and binning; a later run with the same inputs
+    reads the table instead of evaluating the response functions. NONE to disable.
+
+  (resultstore = "NONE") [string]
+    Directory of saved outputs, keyed by a hash of the exposure cube and count map contents,
+    the response functions and their files, and the parameters that affect the output. If the
+    key is found, the saved file is copied to outfile instead of being computed; otherwise the
+    new output is saved. NONE to disable.
+
+  (resultmaxsize = 10000) [float]
+    Limit on the total size of the saved outputs, in MB: the least recently used are removed.
+
+  (resultlink = no) [bool]
+    Hard-link a saved output to outfile instead of copying it. The outfile is then the saved
+    file itself, and is read-only: it must not be modified.
+
+  (hpxnside = 0) [int]
+    If positive, write a HEALPix map of this nside for each energy, in a SKYMAP table,
+    instead of a projected image. The coordinate system is given by coordsys.
+
+  (hpxorder = "RING") [string]
+    Ordering of the HEALPix maps, RING or NESTED.
     
   (chatter = 2) [int] 
     Chattiness of output. 
@@ -42,6 +42,8 @@ int main(int argc, char * argv[]) {
 
         astro::SkyDir center(xref, yref, galactic?  astro::SkyDir::GALACTIC : astro::SkyDir::EQUATORIAL);
         SkyImage copy (center, outfile, pixscale, fov, layers, proj, galactic);
+        int nthreads(pars["nthreads"]);
+        copy.setThreads(nthreads); // the source image is only read, so can be shared
         for( int ilayer = 0; ilayer< layers; ++ilayer){
             std::cout << "copying layer " << ilayer << std::endl;
             image.setLayer(ilayer); // extract only this layer
@@ -0,0 +1,58 @@
+/** @file TestGTIindex.h
+@brief test class for GTIindex
+
+$Header$
+*/
+#include "map_tools/GTIindex.h"
+#include <cmath>
+#include <stdexcept>
+#include <iostream>
+
+
+class TestGTIindex {
+public:
+
+    TestGTIindex(std::ostream& out= std::cout)
+    {
+        using map_tools::GTIindex;
+        out << "\nTesting GTIindex: " << std::endl;
+
+        // two files, unsorted and overlapping: merge to [0,10], [20,30], [40,50]
+        GTIindex::GTIvector first, second;
+        first.push_back(std::make_pair(20., 25.));
+        first.push_back(std::make_pair(0., 10.));
+        second.push_back(std::make_pair(24., 30.));
+        second.push_back(std::make_pair(40., 50.));
+        GTIindex gti(first);
+        gti.add(second);
+        check(gti.size()==3 && gti.intervals()[1]==std::make_pair(20., 30.), "merged intervals");
+
+        // time-ordered rows
+        check(gti.fraction(0, 5)==1.0,      "contained");
+        check(gti.fraction(8, 12)==0.5,     "overlap end");
+        check(gti.fraction(12, 18)==0,      "between");
+        check(gti.fraction(18, 22)==0.5,    "overlap start");
+        check(gti.fraction(25, 45)==0.5,    "spans two intervals");
+        check(!gti.after(45) && gti.after(51), "after");
+
+        // out of order falls back to a binary search
+        check(gti.fraction(2, 4)==1.0,      "out of order");
+        check(gti.fraction(46, 54)==0.5,    "jump ahead");
+
+        // what remains of [5,45] after [0,10], [20,30], [40,50]; and clipping to it
+        GTIindex::GTIvector query(1, std::make_pair(5., 45.)), rest(gti.subtract(query));
+        check(rest.size()==2 && rest[0]==std::make_pair(10., 20.) && rest[1]==std::make_pair(30., 40.), "subtract");
+        GTIindex::GTIvector clipped(gti.clip(5, 45));
+        check(clipped.size()==3 && clipped[0].first==5 && clipped[2].second==45, "clip");
+
+        // no intervals means everything is good
+        GTIindex none;
+        check(none.fraction(1, 2)==1.0 && !none.after(1e10), "empty");
+        out << "GTIindex OK" << std::endl;
+    }
+private:
+    void check(bool ok, const std::string& what)
+    {
+        if( !ok ) throw std::runtime_error("TestGTIindex failed: "+what);
+    }
+};
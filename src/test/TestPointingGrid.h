@@ -0,0 +1,51 @@
+/** @file TestPointingGrid.h
+@brief test class for PointingGrid
+
+$Header$
+*/
+#include "map_tools/PointingGrid.h"
+#include <cmath>
+#include <stdexcept>
+#include <iostream>
+
+
+class TestPointingGrid {
+public:
+
+    TestPointingGrid(std::ostream& out= std::cout)
+    {
+        using map_tools::PointingGrid;
+        using astro::SkyDir;
+        out << "\nTesting PointingGrid: " << std::endl;
+
+        // two passes over the same 10 orientations, the second offset by 0.01 deg
+        PointingGrid grid(0.1);
+        double total(0);
+        for( int pass=0; pass<2; ++pass){
+            for( int i=0; i<10; ++i){
+                double ra(36.*i+0.05+0.01*pass);
+                grid.add(PointingGrid::PointingRow(SkyDir(ra, 20.05), SkyDir(ra+90, 0.05), SkyDir(ra+10, 30.05), 30., 27.));
+                total += 30.;
+            }
+        }
+        std::vector<PointingGrid::PointingRow> rows(grid.rows());
+        check(grid.added()==20, "rows added");
+        check(grid.size()<20 && rows.size()==grid.size(), "rows combined");
+
+        double sum(0), wsum(0);
+        for( std::vector<PointingGrid::PointingRow>::const_iterator it=rows.begin(); it!=rows.end(); ++it){
+            sum += it->deltat; wsum += it->wdeltat;
+        }
+        check(fabs(sum-total)<1e-9 && fabs(wsum-0.9*total)<1e-9, "time conserved");
+
+        // the first cell is the first orientation, moved by no more than the diagonal
+        double bound(sqrt(3.)*0.1);
+        check(rows.front().dirz.difference(SkyDir(0.05, 20.05))*180/M_PI < bound, "direction error bound");
+        out << "PointingGrid: " << grid.added() << " rows in " << grid.size() << " cells, OK" << std::endl;
+    }
+private:
+    void check(bool ok, const std::string& what)
+    {
+        if( !ok ) throw std::runtime_error("TestPointingGrid failed: "+what);
+    }
+};
@@ -6,18 +6,38 @@ $Header: /nfs/slac/g/glast/ground/cvs/map_tools/src/test/test_main.cxx,v 1.34 20
 */
 #include "map_tools/Exposure.h"
 #include "map_tools/SkyImage.h"
+#include "map_tools/BinnerTable.h"
+#include "map_tools/LayerExposure.h"
+#include "map_tools/DiffuseFunction.h"
+#include "map_tools/AeffCache.h"
+#include "map_tools/ResultStore.h"
+#include "map_tools/ContentHash.h"
+#include "map_tools/CubeStore.h"
+#include "map_tools/ExposureSeries.h"
+#include "astro/PointingTransform.h"
 #include "facilities/Util.h"
 #include "hoops/hoops_prompt_group.h"
+#include "tip/IFileSvc.h"
+#include "tip/Table.h"
 
 #include "TestCosineBinner.h"
+#include "TestGTIindex.h"
+#include "TestPointingGrid.h"
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <algorithm>
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <cassert>
+#include <memory>
 #include <stdexcept>
+#include <thread>
 #include <typeinfo>
+#include <sys/stat.h>
+#include <unistd.h>
 using namespace map_tools;
 
 class TestAeff { 
@@ -31,6 +51,89 @@ public:
 };
 
 
+/// function of cos(theta) and phi, for the BinnerTable test
+class TestAeffPhi : public TestAeff {
+public:
+    TestAeffPhi(): TestAeff(0.5){}
+    double integral(double ct, double phi)const{ return (*this)(ct)*(1+0.01*phi); }
+};
+
+/// exposure with a TestAeff, as a function over the sky
+class TestExposure : public astro::SkyFunction {
+public:
+    TestExposure(const Exposure& e): m_e(e){}
+    double operator()(const astro::SkyDir& dir)const{ return m_e(dir, TestAeff(0.5)); }
+private:
+    const Exposure& m_e;
+};
+
+/// a smooth positive function with a different value in each layer, for the DiffuseFunction test
+class TestDiffuse : public astro::SkyFunction {
+public:
+    TestDiffuse(int layer): m_layer(layer){}
+    double operator()(const astro::SkyDir& dir)const{ 
+        return pow(2., -2*m_layer)*(2+cos(dir.ra()*M_PI/180)*cos(dir.dec()*M_PI/180)); 
+    }
+private:
+    int m_layer;
+};
+
+/** write a spacecraft table of n rows, each dt long from t0, with the z-axis scanning in ra
+    @return the table, read back
+*/
+std::unique_ptr<const tip::Table> writePointing(const std::string& file, double t0, int n, double dt, double livetime)
+{
+    std::remove(file.c_str());
+    tip::IFileSvc::instance().createFile(file);
+    tip::IFileSvc::instance().appendTable(file, "SC_DATA");
+    {
+        std::unique_ptr<tip::Table> table(tip::IFileSvc::instance().editTable(file, "SC_DATA"));
+        const char* names[] = {"START", "STOP", "LIVETIME", "RA_SCZ", "DEC_SCZ", "RA_SCX", "DEC_SCX", 
+            "RA_ZENITH", "DEC_ZENITH"};
+        for( int i=0; i<9; ++i) table->appendField(names[i], "1D");
+        table->setNumRecords(n);
+        tip::Table::Iterator row(table->begin());
+        for( int i=0; i<n; ++i, ++row){
+            double ra( fmod(7.*i, 360.) );
+            (*row)["START"].set(t0+i*dt);
+            (*row)["STOP"].set(t0+(i+1)*dt);
+            (*row)["LIVETIME"].set(livetime);
+            (*row)["RA_SCZ"].set(ra);          (*row)["DEC_SCZ"].set(20.);
+            (*row)["RA_SCX"].set(fmod(ra+90, 360.)); (*row)["DEC_SCX"].set(0.);
+            (*row)["RA_ZENITH"].set(fmod(ra+10, 360.)); (*row)["DEC_ZENITH"].set(30.);
+        }
+    }
+    return std::unique_ptr<const tip::Table>(tip::IFileSvc::instance().readTable(file, "SC_DATA"));
+}
+
+/// @return true if the bins of two cubes agree to within a relative tolerance
+bool closeCubes(const Exposure& a, const Exposure& b, double tolerance)
+{
+    if( a.data().size()!=b.data().size() ) return false;
+    SkyBinner::const_iterator ib = b.data().begin();
+    for( SkyBinner::const_iterator ia = a.data().begin(); ia!=a.data().end(); ++ia, ++ib){
+        if( ia->size()!=ib->size() ) return false;
+        for( size_t j=0; j< ia->size(); ++j){
+            double x((*ia)[j]), y((*ib)[j]);
+            if( fabs(x-y) > tolerance*std::max(fabs(y), 1.) ) return false;
+        }
+    }
+    return fabs(a.total()-b.total()) <= tolerance*std::max(fabs(b.total()), 1.);
+}
+
+/// make a quick uniform cube
+double fillUniform(Exposure& e)
+{
+    double total=0;
+    for( double ra=0.5; ra<360; ra+=2.0) {
+        for (double st = -0.95; st < 1.0; st += 0.05){
+            double dec = asin(st)*180/M_PI;
+            e.fill( astro::SkyDir(ra, dec), 1.0);
+            total += 1.0;
+        }
+    }
+    return total;
+}
 
 
 int main(int argc, char** argv ){
@@ -51,14 +154,7 @@ int main(int argc, char** argv ){
         Exposure e( 10,  0.1);
         double total=0;
 #if 1
-        // make a quick uniform cube.
-        for( double ra=0.5; ra<360; ra+=2.0) {
-            for (double st = -0.95; st < 1.0; st += 0.05){
-                double dec = asin(st)*180/M_PI;
-                e.fill( astro::SkyDir(ra, dec), 1.0);
-                total += 1.0;
-            }
-        }
+        total = fillUniform(e);
 #else
         // this is a delta function at (0,0)
         e.fill(astro::SkyDir(0,0), 1.0); 
@@ -98,9 +194,491 @@ int main(int argc, char** argv ){
         // Write this out as a separate file for an external diff.
         e2.write(outfile);
 
+        // the tabulated function must give the same sums as the binner
+        {
+            TestAeffPhi aeff;
+            BinnerTable table(aeff, e.data()[0], false);
+            for( size_t i=0; i<e.data().size(); i+=37){
+                const healpix::CosineBinner& binner(*(e.data().begin()+i));
+                double expect(binner(aeff)), got(table(binner));
+                if( fabs(got-expect) > 1e-6*fabs(expect) ){
+                    throw std::runtime_error("BinnerTable differs from CosineBinner");
+                }
+            }
+        }
+
+        // saved tables must be read back as they were, under a key that depends on the inputs
+        {
+            AeffCache cache(outfile+"_aeffcache");
+            std::vector<double> energies(2, 100.); energies[1]=1000.;
+            AeffCache::Entry entry;
+            entry.tables.push_back(BinnerTable(TestAeff(0.5), e.data()[0], false));
+            entry.tables.push_back(BinnerTable(TestAeffPhi(), e.data()[0], true));
+            entry.etendue.push_back(1.); entry.etendue.push_back(2.);
+            entry.use_phi = true;
+            // a CALDB with the effective area of the response functions, and of another
+            const char* oldcaldb(std::getenv("CALDB"));
+            std::string savedcaldb(oldcaldb!=0? oldcaldb : ""), caldb(outfile+"_caldb");
+            mkdir(caldb.c_str(), 0755); mkdir((caldb+"/bcf").c_str(), 0755); mkdir((caldb+"/bcf/ea").c_str(), 0755);
+            std::string aefffile(caldb+"/bcf/ea/aeff_TEST_V1_FB.fits");
+            std::ofstream(aefffile.c_str()) << "first version";
+            std::ofstream((caldb+"/bcf/ea/aeff_OTHER_V1_FB.fits").c_str()) << "other";
+            setenv("CALDB", caldb.c_str(), 1);
+            std::vector<std::string> files(AeffCache::irfFiles(std::vector<std::string>(1, "TEST_V1::FRONT")));
+            if( files.size()!=1 || files[0]!=aefffile ){
+                throw std::runtime_error("AeffCache::irfFiles did not find the effective area file");
+            }
+            // the name of the group is enough, so that a key is made without loading the response functions
+            if( AeffCache::irfFiles(std::vector<std::string>(1, "TEST_V1"))!=files ){
+                throw std::runtime_error("AeffCache::irfFiles differs for the group name");
+            }
+            std::string key(AeffCache::key("TEST_V1", files, energies, 0.25, true));
+            if( key==AeffCache::key("TEST_V1", files, energies, 0.2, true) ){
+                throw std::runtime_error("AeffCache key does not depend on the theta cut");
+            }
+            // replaced in place, as by a CALDB update
+            std::ofstream(aefffile.c_str()) << "second version, longer";
+            if( key==AeffCache::key("TEST_V1", files, energies, 0.25, true) ){
+                throw std::runtime_error("AeffCache key does not depend on the response function files");
+            }
+            if( oldcaldb!=0 ) setenv("CALDB", savedcaldb.c_str(), 1); 
+            else unsetenv("CALDB");
+            cache.store(key, entry);
+            AeffCache::Entry found;
+            if( !cache.find(key, found) || found.etendue!=entry.etendue || !found.use_phi 
+                || found.tables.size()!=2 ){
+                throw std::runtime_error("AeffCache did not find the stored tables");
+            }
+            for( size_t k=0; k<2; ++k){
+                if( found.tables[k].size()!=entry.tables[k].size() ) throw std::runtime_error("AeffCache table size");
+                for( size_t j=0; j<entry.tables[k].size(); ++j){
+                    if( found.tables[k][j]!=entry.tables[k][j] ) throw std::runtime_error("AeffCache table value");
+                }
+            }
+        }
+
+        // a saved output must be provided again, and the oldest evicted over the size limit
+        {
+            std::ifstream in(outfile.c_str(), std::ios::binary|std::ios::ate);
+            double filesize(static_cast<double>(in.tellg()));
+            ResultStore store(outfile+"_results", 1.5*filesize);
+            std::string key1(ContentHash().add("first").str()), key2(ContentHash().add("second").str());
+            store.save(key1, outfile);
+            std::string copy(outfile+"_fetched.fits");
+            if( !store.fetch(key1, copy) || ContentHash().addFile(copy).value()!=ContentHash().addFile(outfile).value() ){
+                throw std::runtime_error("ResultStore did not provide the saved file");
+            }
+            // by default the output is a copy of its own, which the user may modify
+            struct stat saved, fetched;
+            stat(store.path(key1).c_str(), &saved);
+            stat(copy.c_str(), &fetched);
+            if( saved.st_ino==fetched.st_ino || access(copy.c_str(), W_OK)!=0 ){
+                throw std::runtime_error("ResultStore output shares the saved file");
+            }
+            ResultStore linking(outfile+"_results", 1.5*filesize, true);
+            std::string linked(outfile+"_linked.fits");
+            if( !linking.fetch(key1, linked) ) throw std::runtime_error("ResultStore did not link the saved file");
+            stat(linked.c_str(), &fetched);
+            if( saved.st_ino!=fetched.st_ino && saved.st_dev==fetched.st_dev ){
+                throw std::runtime_error("ResultStore copied when asked to link");
+            }
+            if( store.fetch(key2, copy) ) throw std::runtime_error("ResultStore found a key that was not saved");
+            if( store.fetch(key1, copy, false) ) throw std::runtime_error("ResultStore replaced a file without clobber");
+            store.save(key2, outfile);
+            if( store.size() > 1.5*filesize ) throw std::runtime_error("ResultStore did not evict");
+        }
+
+        // the product for all layers must match the table for each layer
+        {
+            std::vector<BinnerTable> tables;
+            for( int k=0; k<17; ++k){
+                tables.push_back(BinnerTable(TestAeff(0.05*k), e.data()[0], false));
+            }
+            LayerExposure layers(e, tables);
+            std::vector<astro::SkyDir> dirs;
+            for( double ra=1; ra<360; ra+=3){
+                for( double dec=-88; dec<90; dec+=4) dirs.push_back(astro::SkyDir(ra, dec));
+            }
+            std::vector<double> expect(dirs.size()*tables.size());
+            for( size_t k=0; k<tables.size(); ++k){
+                for( size_t i=0; i<dirs.size(); ++i){
+                    expect[i*tables.size()+k] = tables[k](e.data()[dirs[i]]);
+                }
+            }
+            std::vector<double> got;
+            layers(dirs, got);
+            for( size_t i=0; i<expect.size(); ++i){
+                if( fabs(got[i]-expect[i]) > 1e-12*fabs(expect[i]) ){
+                    throw std::runtime_error("LayerExposure differs from BinnerTable");
+                }
+            }
+            // lookups by HEALPix index must give the same values as by direction
+            std::vector<long> pix;
+            for( size_t i=0; i<dirs.size(); ++i){
+                pix.push_back(healpix::Healpix::Pixel(dirs[i], e.data().healpix()).index());
+            }
+            std::vector<double> bypix;
+            layers(pix, bypix);
+            if( bypix!=got ) throw std::runtime_error("LayerExposure by index differs from by direction");
+            std::vector<double> bydir, byindex(pix.size());
+            e.exposure(dirs, TestAeff(0.5), bydir);
+            e.exposure(&pix[0], pix.size(), TestAeff(0.5), &byindex[0]);
+            for( size_t i=0; i<dirs.size(); ++i){
+                if( bydir[i]!=e(dirs[i], TestAeff(0.5)) || byindex[i]!=bydir[i] ){
+                    throw std::runtime_error("exposure by index differs from by direction");
+                }
+            }
+            // an index outside the pixelization gives 0, singly or in a set
+            long outside[] = {-1, long(e.data().size())};
+            double outvalues[2] = {1, 1};
+            e.exposure(outside, 2, TestAeff(0.5), outvalues);
+            if( e.exposure(outside[0], TestAeff(0.5))!=0 || e.exposure(outside[1], TestAeff(0.5))!=0
+                || outvalues[0]!=0 || outvalues[1]!=0 ){
+                throw std::runtime_error("exposure of an index outside the pixelization is not 0");
+            }
+        }
+
+        // an image filled over several threads must match one filled serially
+        {
+            std::string serialfile(outfile+"_serial.fits"), threadedfile(outfile+"_threaded.fits");
+            SkyImage serial(astro::SkyDir(0,0), serialfile, 2., 180., 1, "AIT"),
+                threaded(astro::SkyDir(0,0), threadedfile, 2., 180., 1, "AIT");
+            threaded.setThreads(4);
+            TestExposure fun(e);
+            serial.fill(fun);
+            threaded.fill(fun);
+            if( serial.count()!=threaded.count() || serial.minimum()!=threaded.minimum() 
+                || serial.maximum()!=threaded.maximum() 
+                || fabs(serial.total()-threaded.total()) > 1e-12*fabs(serial.total()) ){
+                throw std::runtime_error("threaded image fill statistics differ from serial fill");
+            }
+            for( double l=-170; l<180; l+=7){
+                for( double b=-85; b<90; b+=5){
+                    astro::SkyDir dir(l, b);
+                    if( serial.pixelValue(dir)!=threaded.pixelValue(dir) ){
+                        throw std::runtime_error("threaded image fill differs from serial fill");
+                    }
+                }
+            }
+            // the cached HEALPix indices must select the pixels that the cube would
+            const SkyImage::Geometry& g(serial.geometry(e.data().healpix()));
+            for( size_t k=0; k<g.valid.size(); ++k){
+                if( !g.valid[k] ) continue;
+                if( &e.data()[g.dir(k)] != &*(e.data().begin()+g.index[k]) ){
+                    throw std::runtime_error("SkyImage geometry has wrong HEALPix index");
+                }
+            }
+        }
+
+        // a shared DiffuseFunction evaluated from several threads must match setEnergy
+        {
+            std::string cubefile(outfile+"_diffuse.fits");
+            {
+                SkyImage cube(astro::SkyDir(0,0), cubefile, 5., 180., 17, "CAR");
+                for( int k=0; k<17; ++k) cube.fill(TestDiffuse(k), k);
+            } // written by the destructor
+            DiffuseFunction diffuse(cubefile);
+            std::vector<astro::SkyDir> dirs;
+            for( double l=-170; l<180; l+=20){
+                for( double b=-80; b<90; b+=20) dirs.push_back(astro::SkyDir(l, b));
+            }
+            std::vector<double> energies;
+            for( double energy=30; energy<1e6; energy*=1.7) energies.push_back(energy);
+            std::vector<double> expect;
+            DiffuseFunction stateful(diffuse); // shares the map
+            for( size_t i=0; i<dirs.size(); ++i){
+                for( size_t j=0; j<energies.size(); ++j){
+                    stateful.setEnergy(energies[j]);
+                    expect.push_back(stateful(dirs[i]));
+                }
+            }
+            if( &stateful.image()!=&diffuse.image() ){
+                throw std::runtime_error("copy of DiffuseFunction does not share the map");
+            }
+            const int nthreads(4);
+            std::vector<std::vector<double> > found(nthreads);
+            std::vector<std::thread> threads;
+            for( int t=0; t<nthreads; ++t){
+                threads.push_back(std::thread([&, t](){
+                    for( size_t i=0; i<dirs.size(); ++i){
+                        unsigned int pixel(diffuse.image().pixelIndex(dirs[i]));
+                        for( size_t j=0; j<energies.size(); ++j){
+                            // alternate the two forms
+                            found[t].push_back( (i+t)%2? diffuse.value(dirs[i], energies[j]) 
+                                : diffuse.value(pixel, energies[j]) );
+                        }
+                    }
+                }));
+            }
+            for( int t=0; t<nthreads; ++t) threads[t].join();
+            for( int t=0; t<nthreads; ++t){
+                if( found[t]!=expect ){
+                    throw std::runtime_error("DiffuseFunction::value differs from setEnergy");
+                }
+            }
+            // the integrals over a set of bins, from one projection, must match those of single bins
+            std::vector<double> edges;
+            for( double energy=100; energy<1e5; energy*=2.5) edges.push_back(energy);
+            for( size_t i=0; i<dirs.size(); ++i){
+                std::vector<double> bins(diffuse.integral(dirs[i], edges));
+                unsigned int pixel(diffuse.image().pixelIndex(dirs[i]));
+                for( size_t j=0; j+1<edges.size(); ++j){
+                    if( bins[j]!=diffuse.integral(dirs[i], edges[j], edges[j+1]) 
+                        || bins[j]!=diffuse.integral(pixel, edges[j], edges[j+1]) ){
+                        throw std::runtime_error("DiffuseFunction integral over bins differs from single bin");
+                    }
+                }
+            }
+        }
+
+        // a pixel-major cube must hold the same values as the planes
+        {
+            std::string cubefile(outfile+"_spectra.fits"), roundfile(outfile+"_roundtrip.fits");
+            {
+                SkyImage cube(astro::SkyDir(0,0), cubefile, 0.5, 180., 17, "CAR"),
+                    roundtrip(astro::SkyDir(0,0), roundfile, 0.5, 180., 17, "CAR");
+                roundtrip.setLayout(SkyImage::PIXEL_MAJOR); // written back in plane order
+                for( int k=0; k<17; ++k){
+                    cube.fill(TestDiffuse(k), k);
+                    roundtrip.fill(TestDiffuse(k), k);
+                }
+            }
+            SkyImage planes(cubefile), spectra(cubefile, "", SkyImage::PIXEL_MAJOR), roundtrip(roundfile);
+            const std::vector<bool>& valid(planes.geometry().valid);
+            unsigned int npix(valid.size());
+            std::vector<double> a(17), b(17), c(17);
+            for( unsigned int k=0; k<npix; ++k){
+                if( !valid[k] ) continue;
+                planes.layerValues(k, 0, 17, &a[0]);
+                spectra.layerValues(k, 0, 17, &b[0]);
+                roundtrip.layerValues(k, 0, 17, &c[0]);
+                if( a!=b || a!=c || spectra.layerValue(k, 5)!=a[5] ){
+                    throw std::runtime_error("pixel-major SkyImage differs from plane order");
+                }
+            }
+            // read every spectrum, in an order unrelated to the layout
+            double sums[2]={0,0};
+            const SkyImage* images[2]={&planes, &spectra};
+            for( int m=0; m<2; ++m){
+                for( unsigned int i=0; i<npix; ++i){
+                    images[m]->layerValues( (i*7919UL)%npix, 0, 17, &a[0]);
+                    sums[m] += a[0]+a[8]+a[16];
+                }
+            }
+            if( sums[0]!=sums[1] ){
+                throw std::runtime_error("pixel-major spectra differ from plane order");
+            }
+            // lookups by direction must find the same pixel, and values, in either layout
+            std::shared_ptr<const SkyImage> byplane(new SkyImage(cubefile)), 
+                bypixel(new SkyImage(cubefile, "", SkyImage::PIXEL_MAJOR));
+            DiffuseFunction planediffuse(byplane), pixeldiffuse(bypixel);
+            for( double l=-170; l<180; l+=20){
+                for( double b=-80; b<90; b+=20){
+                    astro::SkyDir dir(l, b);
+                    unsigned int pixel(bypixel->pixelIndex(dir));
+                    if( pixel!=byplane->pixelIndex(dir) 
+                        || bypixel->layerValue(pixel, 7)!=byplane->layerValue(pixel, 7)
+                        || bypixel->pixelValue(dir, 7)!=byplane->pixelValue(dir, 7)
+                        || pixeldiffuse.value(dir, 1000.)!=planediffuse.value(dir, 1000.)
+                        || pixeldiffuse.integral(dir, 200., 500.)!=planediffuse.integral(dir, 200., 500.) ){
+                        throw std::runtime_error("pixel-major SkyImage lookup by direction differs from plane order");
+                    }
+                }
+            }
+        }
+
+        // a threaded fill must give the same cube as the serial one
+        Exposure et( 10, 0.1);
+        et.setThreads(4);
+        fillUniform(et);
+        if( !(et.data()==e.data()) ){
+            throw std::runtime_error("threaded fill differs from serial fill");
+        }
+
+        // a batch, in small tiles over several threads, must match one row at a time
+        Exposure erow( 10, 0.1, 0.2), ebatch( 10, 0.1, 0.2);
+        ebatch.setThreads(3);
+        ebatch.setTileSize(104);
+        std::vector<Exposure::PointingRow> rows;
+        for( double ra=5; ra<360; ra+=30) {
+            astro::SkyDir dirz(ra, 20), dirx(ra+90, 0), zenith(ra+10, 30);
+            erow.fill_zenith(dirz, dirx, zenith, 1.0);
+            rows.push_back(Exposure::PointingRow(dirz, dirx, zenith, 1.0));
+        }
+        ebatch.fill_batch(rows);
+        if( !(erow.data()==ebatch.data()) || erow.total()!=ebatch.total() || erow.lost()!=ebatch.lost() ){
+            throw std::runtime_error("fill_batch differs from fill_zenith");
+        }
+
+        // filling a weighted exposure in the same pass must match filling it separately
+        Exposure edual( 10, 0.1, 0.2), eweighted( 10, 0.1, 0.2, true), eseparate( 10, 0.1, 0.2, true);
+        std::vector<Exposure::PointingRow> wrows;
+        for( std::vector<Exposure::PointingRow>::iterator it=rows.begin(); it!=rows.end(); ++it){
+            it->wdeltat = 0.9*it->deltat;
+            wrows.push_back(Exposure::PointingRow(it->dirz, it->dirx, it->zenith, it->wdeltat));
+        }
+        edual.fill_batch(rows, &eweighted);
+        eseparate.fill_batch(wrows);
+        if( !(edual.data()==erow.data()) || !(eweighted.data()==eseparate.data()) 
+            || eweighted.total()!=eseparate.total() ){
+            throw std::runtime_error("weighted fill_batch differs from separate fill");
+        }
+
+        // pruning must not change the cube: compare with and without it
+        Exposure pruned( 1, 0.1, 0.2), full( 1, 0.1, 0.2);
+        full.setPruning(false);
+        std::vector<Exposure::PointingRow> orbit;
+        for( double ra=0; ra<360; ra+=2) {
+            orbit.push_back(Exposure::PointingRow(
+                astro::SkyDir(ra, 25), astro::SkyDir(ra+90, 0), astro::SkyDir(ra+20, 10), 30.));
+        }
+        full.fill_batch(orbit);
+        pruned.fill_batch(orbit);
+        if( !(pruned.data()==full.data()) 
+            || fabs(pruned.total()-full.total()) > 1e-9*full.total() 
+            || fabs(pruned.lost()-full.lost()) > 1e-9*full.lost() ){
+            throw std::runtime_error("pruned fill differs from full fill");
+        }
+
+        // phi bins found without trig must agree with CosineBinner::fill
+        healpix::CosineBinner::setPhiBins(5);
+        {
+            Exposure ephi( 10, 0.1);
+            astro::SkyDir dirz(30, 40), dirx(120, 0);
+            ephi.fill_zenith(dirz, dirx, astro::SkyDir(30, 40), 1.0);
+            CLHEP::HepRotation rot(astro::PointingTransform(dirz, dirx).localToCelestial().inverse());
+            for( SkyBinner::iterator it=ephi.data().begin(); it!=ephi.data().end(); ++it){
+                CLHEP::Hep3Vector d( rot*ephi.data().dir(it)() );
+                healpix::CosineBinner expect;
+                expect.fill(d.z(), d.phi(), 1.0);
+                if( !(expect==*it) ){
+                    throw std::runtime_error("phi binning differs from CosineBinner::fill");
+                }
+            }
+        }
+        healpix::CosineBinner::setPhiBins(0);
+
+        // the exposure of a window from a CubeStore must match a fill of the window itself,
+        // early or late in the store, on checkpoints or between them
+        {
+            double t0(1000.), dt(30.), cadence(600.);
+            int nrows(400);
+            std::unique_ptr<const tip::Table> sc(writePointing(outfile+"_ft2.fits", t0, nrows, dt, 1e5));
+            std::string dir(outfile+"_store");
+            std::remove((dir+"/index.txt").c_str()); // start a new store
+            {
+                CubeStore store(dir);
+                store.update(sc.get(), cadence, t0, Exposure::GTIvector(), 10., 0.1);
+            }
+            CubeStore store(dir); // as read from the index
+            double last(t0+nrows*dt);
+            if( store.size()!=size_t((last-t0)/cadence)+1 || store.time(0)!=t0 || store.time(1)!=t0+cadence 
+                || store.time(store.size()-1)!=last ){
+                throw std::runtime_error("CubeStore index does not hold the checkpoints");
+            }
+            double windows[][2] = {{t0+cadence, t0+3*cadence}, {t0+700, t0+1900}, 
+                {last-2*cadence, last}, {last-1000, last-100}, {t0+100, t0+400}};
+            for( int w=0; w<5; ++w){
+                std::unique_ptr<Exposure> ex, ex2;
+                store.query(windows[w][0], windows[w][1], sc.get(), ex, ex2);
+                Exposure direct(10, 0.1), direct2(10, 0.1, -1, true);
+                Exposure::GTIvector window(1, std::make_pair(windows[w][0], windows[w][1]));
+                direct.load(sc.get(), direct2, window, false);
+                if( !closeCubes(*ex, direct, 1e-5) || !closeCubes(*ex2, direct2, 1e-5) 
+                    || ex->coverage()!=window ){
+                    throw std::runtime_error("CubeStore query differs from a fill of the window");
+                }
+                // the weighted cube of a dual load includes the same times
+                if( direct2.coverage()!=window || ex2->coverage()!=window ){
+                    throw std::runtime_error("weighted exposure coverage differs from the exposure");
+                }
+            }
+        }
+
+        // a threaded load, which keeps one pool of fill threads, must match a serial one
+        {
+            std::unique_ptr<const tip::Table> sc(writePointing(outfile+"_ft2.fits", 1000., 200, 30., 30.));
+            Exposure serial(10, 0.1), pooled(10, 0.1), pooledbatch(10, 0.1);
+            pooled.setThreads(4);
+            pooledbatch.setThreads(3);
+            pooledbatch.setBatchSize(16);
+            serial.load(sc.get(), Exposure::GTIvector(), false);
+            pooled.load(sc.get(), Exposure::GTIvector(), false);
+            pooledbatch.load(sc.get(), Exposure::GTIvector(), false);
+            if( !(serial.data()==pooled.data()) || !(serial.data()==pooledbatch.data()) ){
+                throw std::runtime_error("threaded load differs from serial load");
+            }
+        }
+
+        // only a GTI extension written by writeCoverage is taken as the times in a cube
+        {
+            std::string covfile(outfile+"_coverage.fits"), otherfile(outfile+"_othergti.fits");
+            Exposure ec(10, 0.1);
+            std::unique_ptr<const tip::Table> sc(writePointing(outfile+"_ft2.fits", 1000., 20, 30., 30.));
+            ec.load(sc.get(), Exposure::GTIvector(), false);
+            ec.write(covfile);
+            ec.writeCoverage(covfile);
+            ec.write(otherfile);
+            tip::IFileSvc::instance().appendTable(otherfile, "GTI");
+            {
+                std::unique_ptr<tip::Table> gti(tip::IFileSvc::instance().editTable(otherfile, "GTI"));
+                gti->appendField("START", "1D");
+                gti->appendField("STOP", "1D");
+                gti->setNumRecords(1);
+                (*gti->begin())["START"].set(1000.);
+                (*gti->begin())["STOP"].set(1600.);
+            }
+            if( Exposure(covfile).coverage()!=ec.coverage() || ec.coverage().empty() ){
+                throw std::runtime_error("coverage read back differs from the cube");
+            }
+            if( !Exposure(otherfile).coverage().empty() ){
+                throw std::runtime_error("a GTI extension not written by writeCoverage was taken as coverage");
+            }
+            // a cube with no record of its times cannot be appended to, as every row would be added again
+            Exposure(covfile).checkAppend(0.1, -1.0);
+            bool refused(false);
+            try{
+                Exposure(otherfile).checkAppend(0.1, -1.0);
+            }catch(const std::invalid_argument&){
+                refused = true;
+            }
+            if( !refused ) throw std::runtime_error("append to a cube without coverage was not refused");
+        }
+
+        // an ExposureSeries splits a row at a bin edge: each bin must match a fill of its own times
+        {
+            std::string seriesfile(outfile+"_series.fits");
+            std::unique_ptr<const tip::Table> sc(writePointing(outfile+"_ft2.fits", 1000., 20, 30., 25.));
+            std::vector<double> edges;
+            edges.push_back(1000.); edges.push_back(1315.); edges.push_back(1600.);
+            ExposureSeries series(edges, seriesfile, 10, 0.1);
+            series.setBatchSize(4);
+            series.load(sc.get());
+            series.finish();
+            if( series.written()!=2 ) throw std::runtime_error("ExposureSeries did not write every bin");
+            double singletotal(0);
+            for( size_t k=0; k<2; ++k){
+                Exposure single(10, 0.1), single2(10, 0.1, -1.0, true);
+                single.load(sc.get(), single2, Exposure::GTIvector(1, std::make_pair(edges[k], edges[k+1])), false);
+                std::ostringstream suffix; suffix << "_" << k;
+                if( !closeCubes(Exposure(seriesfile, "Exposure"+suffix.str()), single, 1e-5)
+                    || !closeCubes(Exposure(seriesfile, "WEIGHTED_EXPOSURE"+suffix.str()), single2, 1e-5) ){
+                    throw std::runtime_error("ExposureSeries bin differs from a single cube fill");
+                }
+                singletotal += single.total();
+            }
+            if( fabs(series.total()-singletotal) > 1e-6*singletotal ){
+                throw std::runtime_error("ExposureSeries total differs from that of single cube fills");
+            }
+        }
+
         // now test cos
         TestCosineBinner();
 
+        TestGTIindex();
+
+        TestPointingGrid();
+
         std::cout << "tests OK" << std::endl;
 
     }catch( const std::exception& e){